@@ -0,0 +1,37 @@
+#pragma once
+
+#include "loader.h"
+
+namespace eval {
+	// support for the C++ that bicycle_aot writes. A compiled program embeds the .bcc files
+	// it was made from, loads and assembles them at startup exactly as bicycle_aot did and
+	// gives each chunk its compiled function. A chunk whose code turns out different from
+	// what was compiled is interpreted instead, which is reported, and if no chunk matches the
+	// program doesn't run at all
+	namespace aot {
+		struct embedded_file {
+			const char* path;
+			const uint8_t* data;
+			size_t size;
+		};
+
+		struct compiled_chunk {
+			native_code::entry_fn fn;
+			uint64_t fingerprint;
+		};
+
+		// the code in a .bcc file plus a call to its start fn with args, assembled
+		std::shared_ptr<chunk> load_program(loader& ld, const std::filesystem::path& path,
+			const std::vector<std::string>& args);
+
+		// every chunk in a program: the top one, then the bodies of its fns, depth first
+		void collect_chunks(const std::shared_ptr<chunk>& top, std::vector<std::shared_ptr<chunk>>& out);
+
+		uint64_t fingerprint(const chunk& c);
+
+		// the main of a compiled program, which works like running the .bcc with bicycle_vmi
+		int run(int argc, char* argv[], const char* path,
+			const embedded_file* files, size_t num_files,
+			const compiled_chunk* chunks, size_t num_chunks);
+	}
+}
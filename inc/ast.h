@@ -111,9 +111,10 @@ namespace ast {
 	};
 
 	struct map_value : expression {
-		std::map<size_t, std::shared_ptr<expression>> values;
+		// in source order, which is the order the keys are added in
+		std::vector<std::pair<size_t, std::shared_ptr<expression>>> values;
 
-		map_value(std::map<size_t, std::shared_ptr<expression>> values) : values(values) {}
+		map_value(std::vector<std::pair<size_t, std::shared_ptr<expression>>> values) : values(values) {}
 
 		expr_visit_impl
 	};
@@ -1,133 +1,261 @@
 #pragma once
 
-#include <stack>
+#include <string_view>
+#include <map>
+#include <set>
 #include <functional>
 #include <filesystem>
+#include <type_traits>
+#include <exception>
 #include "ast.h"
+#include "region.h"
+#include "hash_map.h"
+#include "jit.h"
+#include "gc.h"
+#include "rc.h"
 
 namespace eval {
-	struct value {
-		virtual void print(std::ostream& out) = 0;
-		virtual bool equal(std::shared_ptr<value> other) = 0;
-		virtual value* clone() = 0;
-	};
-
-	struct nil_value : public value {
-		void print(std::ostream& out) override {
-			out << "nil";
-		}
+	struct object;
 
-		bool equal(std::shared_ptr<eval::value> other) override {
-			return std::dynamic_pointer_cast<nil_value>(other) != nullptr;
-		}
-		
-		value* clone() override { return new nil_value;  }
+	enum class value_type : uint8_t {
+		nil, int_, bool_, boxed
 	};
 
-	struct str_value : public value {
-		std::string value;
-
-		str_value(std::string v) : value(v) {}
+	// what a heap object is, so values can be told apart without RTTI. Objects defined
+	// outside eval.h, like the std library's files, are native
+	enum class object_kind : uint8_t {
+		str, list, map, fn, cell, native
+	};
 
-		void print(std::ostream& out) override {
-			out << "\"" << value << "\"";
+	// a value as the interpreter sees it: ints, bools and nil are stored inline,
+	// everything else lives in a heap object behind ref
+	struct value {
+		value_type type;
+		union {
+			intptr_t integer;
+			bool boolean;
+		};
+		rc<object> ref;
+
+		value() : type(value_type::nil), integer(0) {}
+		value(bool v) : type(value_type::bool_), integer(0) { boolean = v; }
+		template<typename I, typename = std::enable_if_t<std::is_integral_v<I> && !std::is_same_v<I, bool>>>
+		value(I v) : type(value_type::int_), integer((intptr_t)v) {}
+		template<typename T>
+		value(rc<T> v) : type(value_type::boxed), integer(0), ref(std::move(v)) {}
+		value(const char*) = delete;
+
+		inline bool is_nil() const { return type == value_type::nil; }
+
+		inline intptr_t as_int() const {
+			if (type != value_type::int_) throw std::runtime_error("expected int");
+			return integer;
 		}
 
-		bool equal(std::shared_ptr<eval::value> other) override {
-			auto iv = std::dynamic_pointer_cast<str_value>(other);
-			if (iv != nullptr) return value == iv->value;
-			else return false;
+		inline bool as_bool() const {
+			if (type != value_type::bool_) throw std::runtime_error("expected bool");
+			return boolean;
 		}
 
-		eval::value* clone() override { return new str_value(value);  }
+		// the boxed object if it is a T, otherwise nullptr
+		template<typename T>
+		inline rc<T> as() const { return rc<T>(ptr<T>()); }
+		// the same without taking a reference, for as long as the value holds it
+		template<typename T>
+		inline T* ptr() const;
+
+		void print(std::ostream& out) const;
+		bool equal(const value& other) const;
+		value clone() const;
+		// for objects that hold values, see gc.h
+		void trace(gc::tracer& t) const;
 	};
 
-	struct int_value : public value {
-		intptr_t value;
+	struct object : gc::node {
+		const object_kind kind;
 
-		int_value(intptr_t v) : value(v) {}
+		// only objects that can hold values need to be tracked
+		object(object_kind kind, bool tracked = false) : gc::node(tracked), kind(kind) {}
+		virtual ~object() {}
+		virtual void print(std::ostream& out) = 0;
+		virtual bool equal(const value& other) = 0;
+		virtual object* clone() = 0;
+	};
 
-		void print(std::ostream& out) override {
-			out << value;
+	// every object type names its kind in a static tag. Built in kinds are checked by the
+	// tag alone; native ones are told apart by dynamic_cast, as there may be many of them
+	template<typename T>
+	inline T* value::ptr() const {
+		if (ref == nullptr) return nullptr;
+		if constexpr (T::tag == object_kind::native) return dynamic_cast<T*>(ref.get());
+		else return ref->kind == T::tag ? static_cast<T*>(ref.get()) : nullptr;
+	}
+
+	inline void value::trace(gc::tracer& t) const {
+		if (type == value_type::boxed) t(ref.get());
+	}
+
+	struct str_value final : public object {
+		static constexpr object_kind tag = object_kind::str;
+		// the first length chars; concatenations and clones share buf and only add past its end
+		std::shared_ptr<std::string> buf;
+		size_t length;
+		// saved by key()
+		symbol interned = nullptr;
+
+		str_value(std::string v) : object(tag), buf(std::make_shared<std::string>(std::move(v))), length(buf->size()) {}
+		str_value(std::shared_ptr<std::string> buf, size_t length) : object(tag), buf(std::move(buf)), length(length) {}
+
+		std::string_view str() const { return std::string_view(buf->data(), length); }
+
+		const symbol& key() {
+			if (interned == nullptr) interned = intern(str());
+			return interned;
 		}
 
-		bool equal(std::shared_ptr<eval::value> other) override {
-			auto iv = std::dynamic_pointer_cast<int_value>(other);
-			auto sv = std::dynamic_pointer_cast<str_value>(other);
-			if (iv != nullptr) return value == iv->value;
-			else if (sv != nullptr && sv->value.size() == 1) {
-				return value == sv->value[0];
+		// adds s to the end, in place
+		void append(std::string_view s) {
+			// s may point into buf
+			auto aliased = s.data() >= buf->data() && s.data() < buf->data() + buf->size();
+			if (length != buf->size() || aliased) {
+				auto own = std::make_shared<std::string>();
+				own->reserve(2 * (length + s.size()));
+				own->append(str());
+				own->append(s);
+				buf = std::move(own);
 			}
-			else return false;
+			else buf->append(s);
+			length = buf->size();
+			interned = nullptr;
 		}
 
-		eval::value* clone() override { return new int_value(value); }
-	};
-
-	struct bool_value : public value {
-		bool value;
-
-		bool_value(bool v) : value(v) {}
+		// a followed by b, which goes on the end of a's buffer if a is what ends it
+		static rc<str_value> concat(str_value* a, str_value* b) {
+			auto s = make_rc<str_value>(a->buf, a->length);
+			s->append(b->str());
+			return s;
+		}
 
 		void print(std::ostream& out) override {
-			out << (value ? "true" : "false");
+			out << "\"" << str() << "\"";
 		}
 
-		bool equal(std::shared_ptr<eval::value> other) override {
-			auto iv = std::dynamic_pointer_cast<bool_value>(other);
-			if (iv != nullptr) return value == iv->value;
+		bool equal(const eval::value& other) override {
+			auto iv = other.ptr<str_value>();
+			if (iv != nullptr) return str() == iv->str();
 			else return false;
 		}
 
-		eval::value* clone() override { return new bool_value(value); }
+		object* clone() override { return new str_value(buf, length); }
 	};
 
-	struct list_value : public value {
-		std::vector<std::shared_ptr<value>> values;
+	struct list_value final : public object {
+		static constexpr object_kind tag = object_kind::list;
+		std::vector<value> values;
 
-		list_value(std::vector<std::shared_ptr<value>> values = {}) : values(values) {}
+		list_value(std::vector<value> values = {}) : object(tag, true), values(values) {}
 
 		void print(std::ostream& out) {
 			out << "[ ";
-			for (auto i = 0; i < values.size(); ++i) {
-				values[i]->print(out);
+			for (size_t i = 0; i < values.size(); ++i) {
+				values[i].print(out);
 				if (i + 1 < values.size()) out << ", ";
 			}
 			out << " ]";
 		}
 
-		bool equal(std::shared_ptr<value> other) {
-			auto lv = std::dynamic_pointer_cast<list_value>(other);
+		bool equal(const value& other) {
+			auto lv = other.ptr<list_value>();
 			if (lv != nullptr) {
 				if (lv->values.size() != values.size()) return false;
-				for (auto i = 0; i < values.size(); ++i) {
-					if (!values[i]->equal(lv->values[i])) return false;
+				for (size_t i = 0; i < values.size(); ++i) {
+					if (!values[i].equal(lv->values[i])) return false;
 				}
 				return true;
 			}
 			else return false;
 		}
 
-		eval::value* clone() override {
-			std::vector<std::shared_ptr<value>> nv;
-			for (auto v : values) {
-				nv.push_back(std::shared_ptr<value>(v->clone()));
+		object* clone() override {
+			std::vector<value> nv;
+			for (auto& v : values) {
+				nv.push_back(v.clone());
 			}
 			return new list_value(nv);
 		}
+
+		void trace(gc::tracer& t) override { for (auto& v : values) v.trace(t); }
+		void clear() override { values.clear(); }
 	};
 
-	struct map_value : public value {
-		std::map<std::string, std::shared_ptr<value>> values;
+	// the keys of a map in the order they were added, shared by maps that added the same ones
+	// in the same order, for field_cache. Freed once no map or cache uses it or a shape after it
+	struct shape {
+		size_t uses = 0;
+		size_t size = 0;
+		// the shape this one adds key to
+		rc<shape> parent;
+		symbol key;
+		// the shapes maps of this one turn into when a key is added, which take themselves
+		// out when they are freed
+		hash_map<shape*> transitions;
+
+		// past either of these limits maps are dictionaries, with no shape
+		static constexpr size_t max_size = 32;
+		static constexpr size_t max_transitions = 64;
+		// the shape of a new map, which is never freed
+		static shape* empty;
+
+		shape() = default;
+		shape(const shape&) = delete;
+		shape& operator=(const shape&) = delete;
+		~shape() {
+			if (parent != nullptr) parent->transitions.erase(key);
+		}
 
-		map_value(std::map<std::string, std::shared_ptr<value>> v = {}) : values(v) {}
+		// the shape with key added, or nullptr if the map shouldn't have one
+		shape* with(const symbol& key) {
+			auto t = transitions.find(key);
+			if (t != transitions.end()) return t->second;
+			if (size >= max_size || transitions.size() >= max_transitions) return nullptr;
+			auto s = new shape();
+			s->size = size + 1;
+			s->parent = rc<shape>(this);
+			s->key = key;
+			transitions.add(key)->second = s;
+			return s;
+		}
+	};
+
+	inline shape* shape::empty = [] {
+		auto s = new shape();
+		s->uses = 1;
+		return s;
+	}();
+
+	struct map_value final : public object {
+		static constexpr object_kind tag = object_kind::map;
+		// in the order the keys were added. Keys are only ever added through entry,
+		// which keeps layout up to date
+		hash_map<value> values;
+		// nullptr for maps used as dictionaries
+		rc<shape> layout = rc<shape>(shape::empty);
+
+		map_value() : object(tag, true) {}
+
+		// the entry for key, added as nil if there wasn't one, and whether it was added
+		std::pair<hash_map<value>::iterator, bool> entry(const symbol& key) {
+			auto r = values.try_emplace(key);
+			if (r.second && layout != nullptr) layout = rc<shape>(layout->with(key));
+			return r;
+		}
 
 		void print(std::ostream& out) {
 			out << "{ ";
 			auto i = values.begin();
 			while(i != values.end()) {
-				out << i->first << ": ";
-				i->second->print(out);
+				out << i->first->name << ": ";
+				i->second.print(out);
 				i++;
 				if (i != values.end()) out << ", ";
 				else break;
@@ -135,195 +263,712 @@ namespace eval {
 			out << " }";
 		}
 
-		bool equal(std::shared_ptr<value> other) {
-			auto mv = std::dynamic_pointer_cast<map_value>(other);
-			if (mv != nullptr) {
-				// reference equality really isn't what we want here
-				return &*mv == this;
+		bool equal(const value& other) {
+			// reference equality really isn't what we want here
+			return other.ptr<map_value>() == this;
+		}
+
+		object* clone() override {
+			// the copy keeps the table and shape, so nothing is looked up again
+			auto m = new map_value();
+			m->values = values;
+			m->layout = layout;
+			for (auto& v : m->values) v.second = v.second.clone();
+			return m;
+		}
+
+		void trace(gc::tracer& t) override { for (auto& v : values) v.second.trace(t); }
+		void clear() override {
+			values.clear();
+			layout = rc<shape>(shape::empty);
+		}
+	};
+
+	// calls f with the object as its own type if it is a string, list or map, whose
+	// methods then need no virtual call, and as an object otherwise
+	template<typename F>
+	inline auto with_object(object* o, F f) {
+		switch (o->kind) {
+		case object_kind::str: return f(static_cast<str_value*>(o));
+		case object_kind::list: return f(static_cast<list_value*>(o));
+		case object_kind::map: return f(static_cast<map_value*>(o));
+		default: return f(o);
+		}
+	}
+
+	inline void value::print(std::ostream& out) const {
+		switch (type) {
+		case value_type::nil: out << "nil"; break;
+		case value_type::int_: out << integer; break;
+		case value_type::bool_: out << (boolean ? "true" : "false"); break;
+		case value_type::boxed: with_object(ref.get(), [&](auto o) { o->print(out); }); break;
+		}
+	}
+
+	inline bool value::equal(const value& other) const {
+		switch (type) {
+		case value_type::nil: return other.type == value_type::nil;
+		case value_type::int_: {
+			if (other.type == value_type::int_) return integer == other.integer;
+			auto sv = other.ptr<str_value>();
+			if (sv != nullptr && sv->length == 1) {
+				return integer == sv->str()[0];
 			}
-			return false;
+			else return false;
+		}
+		case value_type::bool_: return other.type == value_type::bool_ && boolean == other.boolean;
+		case value_type::boxed: return with_object(ref.get(), [&](auto o) { return o->equal(other); });
+		}
+		return false;
+	}
+
+	inline value value::clone() const {
+		if (type != value_type::boxed) return *this;
+		return value(rc<object>(with_object(ref.get(), [](auto o) { return o->clone(); })));
+	}
+
+	// what bin_op computes, for the interpreter and for folding constants
+	inline value apply_bin_op(op_type op, const value& a, const value& b) {
+		if (op <= op_type::div) { // math ops
+			auto x = a.as_int(), y = b.as_int();
+			switch (op) {
+			case op_type::add: return x + y;
+			case op_type::sub: return x - y;
+			case op_type::mul: return x * y;
+			case op_type::div: return x / y;
+			default: throw std::runtime_error("unknown op");
+			}
+		}
+		else if (op == op_type::eq) return a.equal(b);
+		else if (op == op_type::neq) return !a.equal(b);
+		else if (op <= op_type::greater_eq) { // compare ops
+			// for now, we can only compare ints
+			auto x = a.as_int(), y = b.as_int();
+			switch (op) {
+			case op_type::less: return x < y;
+			case op_type::less_eq: return x <= y;
+			case op_type::greater: return x > y;
+			case op_type::greater_eq: return x >= y;
+			default: throw std::runtime_error("unknown op");
+			}
+		}
+		else if (op == op_type::and_l || op == op_type::or_l) {
+			auto x = a.as_bool(), y = b.as_bool();
+			return op == op_type::and_l ? x && y : x || y;
 		}
+		else throw std::runtime_error("unexpected op");
+	}
+
+	// the instruction set of the VM
+	// X(name, opcode as in .bcc files, number of operand words)
+	// opcode 64 (include module) is resolved by the loader, and the marker based jumps
+	// (11, 15 and 16) are resolved by link(), so none of them reach the interpreter.
+	// 20-22 address locals by (depth, slot), 23 pushes a shared constant and 24-27 reach
+	// variables captured by closures; only the analyzer produces them.
+	// 34-39 fuse sequences that are hot in the self-hosted compiler: 34-36 take the key
+	// or operator as an operand (and are in .bcc files too), 37-39 work on a local
+	// in place and are analyzer-only.
+	// 40-42 are the register forms the analyzer uses with -r: their operands name frame
+	// slots directly, as (depth, slot) pairs or (reg_constant, constant index) for a
+	// constant, instead of going through the stack.
+	// 43-45 are analyzer-only too: 43 is a bin_op on two locals, and 44 and 45 call a fn
+	// they look up by name or path, instead of having it pushed first.
+	// 70-78 and 83-88 are bin_op and if_bin_op quickened for two ints: the interpreter
+	// rewrites an instruction into them when it sees two ints, and back if it later
+	// sees anything else. They keep the operands of the instruction they replace
+#define BICYCLE_OPCODES(X) \
+	X(nop, 0, 0) \
+	X(discard, 1, 0) \
+	X(duplicate, 2, 0) \
+	X(literal, 3, 1) \
+	X(get_binding, 4, 2) \
+	X(get_qualified_binding, 5, 2) \
+	X(set_binding, 6, 1) \
+	X(bind, 7, 1) \
+	X(enter_scope, 8, 0) \
+	X(exit_scope, 9, 0) \
+	X(exit_scope_as_new_module, 10, 1) \
+	X(bin_op, 12, 1) \
+	X(log_not, 13, 0) \
+	X(jump, 14, 1) \
+	X(make_closure, 17, 1) \
+	X(call, 18, 1) \
+	X(ret, 19, 0) \
+	X(tail_call, 28, 1) \
+	X(enter_block, 20, 1) \
+	X(get_local, 21, 2) \
+	X(set_local, 22, 2) \
+	X(constant, 23, 1) \
+	X(get_cell, 24, 2) \
+	X(set_cell, 25, 2) \
+	X(get_upvalue, 26, 1) \
+	X(set_upvalue, 27, 1) \
+	X(get_index, 30, 0) \
+	X(set_index, 31, 0) \
+	X(get_key, 32, 0) \
+	X(set_key, 33, 0) \
+	X(get_field, 34, 2) \
+	X(set_field, 35, 2) \
+	X(if_bin_op, 36, 3) \
+	X(bin_op_local_const, 37, 4) \
+	X(add_local, 38, 3) \
+	X(get_local_field, 39, 4) \
+	X(move, 40, 4) \
+	X(bin_op_reg, 41, 7) \
+	X(if_bin_op_reg, 42, 7) \
+	X(bin_op_locals, 43, 5) \
+	X(call_binding, 44, 3) \
+	X(call_qualified, 45, 3) \
+	X(append_list, 50, 0) \
+	X(if_abs, 51, 2) \
+	X(system, 52, 1) \
+	X(add_int, 70, 1) \
+	X(sub_int, 71, 1) \
+	X(mul_int, 72, 1) \
+	X(eq_int, 73, 1) \
+	X(neq_int, 74, 1) \
+	X(less_int, 75, 1) \
+	X(greater_int, 76, 1) \
+	X(less_eq_int, 77, 1) \
+	X(greater_eq_int, 78, 1) \
+	X(if_eq_int, 83, 3) \
+	X(if_neq_int, 84, 3) \
+	X(if_less_int, 85, 3) \
+	X(if_greater_int, 86, 3) \
+	X(if_less_eq_int, 87, 3) \
+	X(if_greater_eq_int, 88, 3)
+
+	enum class opcode : uint32_t {
+#define X(name, code, width) name = code,
+		BICYCLE_OPCODES(X)
+#undef X
+	};
+
+	// the depth of a register operand that is a constant rather than a slot
+	const uint32_t reg_constant = UINT32_MAX;
 
-		eval::value* clone() override {
-			std::map<std::string, std::shared_ptr<value>> nv;
-			for (auto v : values) {
-				nv[v.first] = std::shared_ptr<value>(v.second->clone());
+	// number of operand words that follow an opcode
+	inline size_t operand_count(opcode op) {
+		switch (op) {
+#define X(name, code, width) case opcode::name: return width;
+			BICYCLE_OPCODES(X)
+#undef X
+		default: throw std::runtime_error("unknown opcode " + std::to_string((uint32_t)op));
+		}
+	}
+
+	// where a lookup by name last found its binding, in holder. It stays good while the
+	// names looked up haven't been bound anywhere since, holder hasn't grown, and the
+	// lookup reaches the scope anchor through scopes made since (which could only have
+	// bound those names by bumping them). So a fresh block or call scope per iteration
+	// still hits
+	struct binding_cache {
+		size_t anchor = 0, stamp = SIZE_MAX, names = 0, holder_version = 0;
+		struct scope* holder = nullptr;
+		const value* cell = nullptr;
+	};
+
+	// where a field access last found its key, for maps of one shape. A set_field that
+	// added the key remembers the shape it turned the map into as next
+	struct field_cache {
+		rc<shape> layout;
+		rc<shape> next;
+		uint32_t index = 0;
+	};
+
+	// the literals of everything assembled together (a statement, a module or a .bcc
+	// program), shared by the chunks of all the fns inside it. Strings are interned
+	struct constant_pool {
+		std::vector<value> values;
+		std::map<std::string, uint32_t> strings;
+
+		uint32_t add(const value& v) {
+			if (auto s = v.ptr<str_value>()) {
+				auto text = std::string(s->str());
+				auto f = strings.find(text);
+				if (f != strings.end()) return f->second;
+				strings[text] = (uint32_t)values.size();
 			}
-			return new map_value(nv);
+			values.push_back(v);
+			return (uint32_t)values.size() - 1;
 		}
 	};
 
+	// a flat, assembled piece of code plus the tables its operands index into
+	struct chunk {
+		std::vector<uint32_t> code;
+		std::shared_ptr<constant_pool> constants;
+		std::vector<symbol> names;
+		std::vector<std::vector<symbol>> paths;
+		std::vector<std::shared_ptr<struct fn_proto>> fns;
+		std::vector<std::function<void(struct interpreter*)>> natives;
+		// one per get_binding and get_qualified_binding
+		std::vector<binding_cache> caches;
+		// one per get_field, get_local_field and set_field
+		std::vector<field_cache> field_caches;
+		// calls into the chunk and loops run in it, counted until the JIT compiles it
+		size_t heat = 0;
+		std::shared_ptr<native_code> native;
+
+		void print(std::ostream& out);
+	};
+
+	struct assembler;
+
 	struct instr {
 		virtual void print(std::ostream& out) = 0;
-		virtual void exec(struct interpreter*) = 0;
+		virtual void emit(assembler* as) = 0;
 		virtual std::optional<size_t> get_marker_id() { return std::optional<size_t>(); }
+		// rewrite the instruction indices this instruction jumps to
+		virtual void retarget(const std::function<size_t(size_t)>& f) {}
+	};
+
+	struct assembler {
+		std::shared_ptr<chunk> out;
+		// offset of each instruction in out->code, by index in the input
+		std::vector<size_t> offsets;
+		// (operand offset, instruction index) pairs to patch once every offset is known
+		std::vector<std::pair<size_t, size_t>> fixups;
+		std::map<std::string, uint32_t> name_indices;
+
+		assembler(std::shared_ptr<constant_pool> constants = std::make_shared<constant_pool>())
+			: out(std::make_shared<chunk>()) {
+			out->constants = constants;
+		}
+
+		std::shared_ptr<chunk> assemble(const std::vector<std::shared_ptr<instr>>& code);
+
+		inline void op(opcode op) { out->code.push_back((uint32_t)op); }
+		inline void operand(size_t x) { out->code.push_back((uint32_t)x); }
+		inline void cache() {
+			operand(out->caches.size());
+			out->caches.emplace_back();
+		}
+		inline void field_cache() {
+			operand(out->field_caches.size());
+			out->field_caches.emplace_back();
+		}
+		inline void target(size_t instr_index) {
+			fixups.push_back({ out->code.size(), instr_index });
+			out->code.push_back(0);
+		}
+		uint32_t name(const std::string& n) {
+			auto f = name_indices.find(n);
+			if (f != name_indices.end()) return f->second;
+			auto ix = (uint32_t)out->names.size();
+			out->names.push_back(intern(n));
+			name_indices[n] = ix;
+			return ix;
+		}
 	};
 
+	std::shared_ptr<chunk> assemble(const std::vector<std::shared_ptr<instr>>& code,
+		std::shared_ptr<constant_pool> constants = std::make_shared<constant_pool>());
+
 	struct marker_instr : public instr {
 		size_t id;
 		marker_instr(size_t id) : id(id) {}
-		void exec(struct interpreter* intp) override { }
+		void emit(assembler* as) override { throw std::runtime_error("marker must be linked before assembly"); }
 		void print(std::ostream& out) override { out << "mark " << id << ":" << std::endl; }
 		std::optional<size_t> get_marker_id() override { return id;  }
 	};
 
 
-	struct scope {
-		std::shared_ptr<scope> parent;
-		std::map<std::string, std::shared_ptr<value>> bindings;
-		std::map<std::string, std::shared_ptr<scope>> modules;
+	struct scope : gc::node {
+		rc<scope> parent;
+		// locals the analyzer resolved to a slot; everything else is bound by name
+		std::vector<value, region_allocator<value>> slots;
+		hash_map<value> bindings;
+		hash_map<rc<scope>> modules;
+		// unique for the life of the program, unlike the address of the scope
+		size_t id;
+		// whether code can bind names in it: the global scope, modules and the scopes of
+		// fns that aren't flat. Blocks and flat fns only have slots
+		bool by_name;
+		// bumped whenever a name or module is added to it, which may move the bindings
+		// already there
+		size_t version = 0;
+
+		static inline size_t next_id = 1;
+
+		scope(rc<scope> parent) : parent(std::move(parent)), bindings(), modules(), id(next_id++), by_name(true) {}
+		scope(rc<scope> parent, size_t num_slots, bool by_name)
+			: parent(std::move(parent)), slots(num_slots), bindings(), modules(), id(next_id++), by_name(by_name) {}
+		scope(std::string name, rc<scope> parent) : parent(std::move(parent)), bindings(), modules(), id(next_id++), by_name(true) {}
+
+		// scopes come and go with every block and call, so they live in the region, see region.h
+		static void* operator new(size_t size) { return region::allocate(size); }
+		static void operator delete(void* p, size_t size) { region::deallocate(p, size); }
+
+		static rc<scope> make(rc<scope> parent, size_t num_slots = 0, bool by_name = true) {
+			return make_rc<scope>(std::move(parent), num_slots, by_name);
+		}
 
-		scope(std::shared_ptr<scope> parent) : parent(parent), bindings(), modules() {}
-		scope(std::string name, std::shared_ptr<scope> parent) : parent(parent), bindings(), modules() {}
+		// where lookups by name from here actually start: scopes that can't bind names
+		// can't change what they find. A by name scope counts even while it is still
+		// empty, since what is bound in it later has to be found through it
+		scope* named() {
+			auto s = this;
+			while (!s->by_name && s->parent != nullptr) s = s->parent.get();
+			return s;
+		}
 
-		std::shared_ptr<value> binding(const std::string& name) {
-			auto f = bindings.find(name);
-			if (f != bindings.end()) return f->second;
-			else if (parent != nullptr) {
-				return parent->binding(name);
+		// the binding for name here or in a parent, or nullptr, and the scope holding it
+		value* find_binding(const symbol& name, scope** holder = nullptr) {
+			for (auto s = this; s != nullptr; s = s->parent.get()) {
+				auto f = s->bindings.find(name);
+				if (f != s->bindings.end()) {
+					if (holder != nullptr) *holder = s;
+					return &f->second;
+				}
 			}
-			else throw std::runtime_error("unbound identifier " + name);
+			return nullptr;
+		}
+
+		const value& binding(const symbol& name, scope** holder = nullptr) {
+			if (auto v = find_binding(name, holder)) return *v;
+			else throw std::runtime_error("unbound identifier " + name->name);
 		}
+		const value& binding(const std::string& name) { return binding(intern(name)); }
 
-		std::shared_ptr<value> qualified_binding(const std::vector<std::string>& path, int index = 0) {
+		const value& qualified_binding(const std::vector<symbol>& path, size_t index = 0, scope** holder = nullptr) {
 			if (index == path.size()-1) {
-				return binding(path[index]);
+				return binding(path[index], holder);
 			} else {
 				auto m = modules.find(path[index]);
 				if (m != modules.end()) {
-					return m->second->qualified_binding(path, index + 1);
+					return m->second->qualified_binding(path, index + 1, holder);
 				}
 				else if(parent != nullptr) {
-					return parent->qualified_binding(path, index);
+					return parent->qualified_binding(path, index, holder);
 				}
 				else {
 					std::string s;
-					for (auto p : path) s += p + "|";
+					for (auto& p : path) s += p->name + "|";
 					throw std::runtime_error("unbound path: " + s);
 				}
 			}
 		}
 
-		void binding(const std::string& name, std::shared_ptr<value> v) {
-			auto f = bindings.find(name);
-			if (f != bindings.end()) f->second = v;
-			else if (parent != nullptr) {
-				parent->binding(name, v);
-			}
-			else throw std::runtime_error("unbound identifier " + name);
+		void binding(const symbol& name, const value& v) {
+			if (auto b = find_binding(name)) *b = v;
+			else throw std::runtime_error("unbound identifier " + name->name);
 		}
 
-		void bind(const std::string& name, std::shared_ptr<value> v) {
-			bindings[name] = v;
+		void bind(const symbol& name, const value& v) {
+			if (bindings.insert_or_assign(name, v).second) added(name);
+		}
+		void bind(const std::string& name, const value& v) { bind(intern(name), v); }
+
+		void bind_module(const symbol& name, rc<scope> m) {
+			modules[name] = std::move(m);
+			added(name);
+		}
+
+		// what a lookup cached in a binding_cache may have missed
+		void added(const symbol& name) {
+			version++;
+			name->version++;
+		}
+
+		void trace(gc::tracer& t) override {
+			if (parent != nullptr) t(parent.get());
+			for (auto& v : slots) v.trace(t);
+			for (auto& b : bindings) b.second.trace(t);
+			for (auto& m : modules) t(m.second.get());
+		}
+		void clear() override {
+			parent = nullptr;
+			slots.clear();
+			bindings.clear();
+			modules.clear();
 		}
 	};
 
-	struct fn_value : public value {
+	// a scope as the analyzer sees it, while it is compiling the code that will run in it
+	struct lexical_scope {
+		enum kind_t {
+			// the global scope and modules: bindings are only known by name at runtime
+			by_name,
+			// holds a fn's arguments and the locals of its outermost block
+			fn,
+			block
+		} kind;
+		std::shared_ptr<lexical_scope> parent;
+		// names of the slots declared so far, in slot order
+		std::vector<std::string> locals;
+		// slots some closure captures, which then live in a cell
+		std::vector<bool> captured;
+
+		// for fn scopes, the variables of enclosing code the fn captures: the scope and
+		// slot declaring it, and if that isn't in the code that makes the closure, the
+		// index of the upvalue of the enclosing fn that holds it
+		struct upvalue {
+			std::shared_ptr<lexical_scope> scope;
+			size_t slot;
+			std::optional<size_t> outer;
+		};
+		std::vector<upvalue> upvalues;
+
+		lexical_scope(kind_t kind, std::shared_ptr<lexical_scope> parent) : kind(kind), parent(parent), locals() {}
+
+		std::optional<size_t> slot(const std::string& name) const {
+			for (size_t i = 0; i < locals.size(); ++i)
+				if (locals[i] == name) return i;
+			return std::nullopt;
+		}
+
+		// let reuses the slot of a name the scope already declares, like binding by name did
+		size_t declare(const std::string& name) {
+			auto s = slot(name);
+			if (s.has_value()) return s.value();
+			locals.push_back(name);
+			captured.push_back(false);
+			return locals.size() - 1;
+		}
+
+		// blocks that declare nothing never get a scope at runtime
+		bool exists() const { return kind != block || !locals.empty(); }
+	};
+
+	// a use of a name by the analyzer
+	struct variable {
+		std::string name;
+		// the scope the use appears in
+		std::shared_ptr<lexical_scope> from;
+		// the scope declaring it, if it is a local of the fn the use appears in
+		std::shared_ptr<lexical_scope> to;
+		size_t slot;
+		// index into the fn's upvalues, if it is a local of enclosing code
+		std::optional<size_t> upvalue;
+
+		variable(std::string name, std::shared_ptr<lexical_scope> from, std::shared_ptr<lexical_scope> to = nullptr, size_t slot = 0)
+			: name(name), from(from), to(to), slot(slot) {}
+
+		// look for a name that isn't a local of this fn in the enclosing code, which by now
+		// has declared everything it will, and capture it in every fn in between.
+		// Otherwise it is looked up by name when it runs
+		void resolve_free();
+		// number of runtime scopes between the use and the scope declaring it
+		size_t depth() const;
+		// whether it can be addressed with get_local and set_local (only known once
+		// the enclosing statement is analyzed)
+		bool in_slot() const { return !upvalue.has_value() && to != nullptr && !to->captured[slot]; }
+	};
+
+	// where make_closure finds the cell of a captured variable: a slot (depth, index) of
+	// the scopes it runs in, or the upvalue index of the fn it runs in
+	struct capture {
+		bool from_upvalue;
+		uint32_t depth, index;
+	};
+
+	// a variable captured by closures, shared between them and the scope that declares it
+	struct cell final : public object {
+		static constexpr object_kind tag = object_kind::cell;
+		eval::value value;
+
+		cell(eval::value v) : object(tag, true), value(v) {}
+
+		void print(std::ostream& out) override { value.print(out); }
+		bool equal(const eval::value& other) override { return value.equal(other); }
+		object* clone() override { return new cell(value); }
+		void trace(gc::tracer& t) override { value.trace(t); }
+		void clear() override { value = eval::value(); }
+	};
+
+	// everything about a fn that doesn't depend on where it was created, shared by
+	// all the closures made from it
+	struct fn_proto {
 		std::optional<std::string> name;
 		std::vector<std::string> arg_names;
-		std::vector<std::shared_ptr<instr>> body;
-		std::shared_ptr<scope> closure;
-
-		fn_value(std::vector<std::string> an,
-			std::vector<std::shared_ptr<instr>> body,
-			std::shared_ptr<scope> c,
-			std::optional<std::string> name = std::nullopt) : arg_names(an), body(body), closure(c), name(name) {}
+		// arg_names interned, for binding the arguments of fns that aren't flat
+		std::vector<symbol> arg_symbols;
+		std::shared_ptr<chunk> body;
+		// fns the analyzer compiled keep their arguments and locals in slots, see the
+		// variables of enclosing code only through the cells they capture, and hold on to
+		// nothing but the nearest scope with names. Natives and fns loaded from .bcc files
+		// get their arguments by name and keep the whole scope they were made in
+		bool flat;
+		// size of the slot frame, arguments first
+		size_t num_locals;
+		std::vector<capture> captures;
+
+		fn_proto(std::vector<std::string> an,
+			std::shared_ptr<chunk> body,
+			std::optional<std::string> name = std::nullopt,
+			bool flat = false, size_t num_locals = 0, std::vector<capture> captures = {})
+			: name(name), arg_names(an), body(body), flat(flat), num_locals(num_locals), captures(captures) {
+			for (auto& n : arg_names) arg_symbols.push_back(intern(n));
+		}
 
-		void print(std::ostream& out) override {
+		void print(std::ostream& out) {
 			out << "fn";
 			if (name.has_value()) {
 				out << " " << name.value() << " ";
 			}
 			out << "(";
-			for (auto i = 0; i < arg_names.size(); ++i) {
+			for (size_t i = 0; i < arg_names.size(); ++i) {
 				out << arg_names[i];
 				if (i + 1 < arg_names.size()) out << ", ";
 			}
 			out << ")";
+		}
+	};
+
+	struct fn_value final : public object {
+		static constexpr object_kind tag = object_kind::fn;
+		std::shared_ptr<fn_proto> proto;
+		rc<scope> closure;
+		std::vector<rc<cell>> upvalues;
+
+		fn_value(std::shared_ptr<fn_proto> proto, rc<scope> c) : object(tag, true), proto(proto), closure(c) {}
+
+		void print(std::ostream& out) override {
+			proto->print(out);
 			if (closure != nullptr) {
 				out << "&";
 			}
 			out << std::endl;
-			for (auto i = 0; i < body.size(); ++i) {
-				out << i << "\t";
-				body[i]->print(out);
-			}
+			proto->body->print(out);
 		}
 
-		bool equal(std::shared_ptr<eval::value> other) override {
+		bool equal(const value& other) override {
 			return false;
 		}
 
 
-		eval::value* clone() override {
-			return new fn_value(arg_names, body, closure, name);
+		object* clone() override {
+			auto f = new fn_value(proto, closure);
+			f->upvalues = upvalues;
+			return f;
+		}
+
+		void trace(gc::tracer& t) override {
+			if (closure != nullptr) t(closure.get());
+			for (auto& u : upvalues) t(u.get());
+		}
+		void clear() override {
+			closure = nullptr;
+			upvalues.clear();
 		}
 	};
 
-	struct interpreter {
-		std::shared_ptr<scope> current_scope, global_scope;
-		size_t pc; std::vector<std::shared_ptr<instr>> code;
-		std::stack<std::shared_ptr<value>> stack;
-
-		interpreter(std::shared_ptr<scope> global_scope, std::vector<std::shared_ptr<instr>> code)
-			: global_scope(global_scope), current_scope(global_scope), pc(0), stack(), code(code) {}
-
-		void debug_print_state() {
-			std::cout << "stack [";
-			if(stack.size() > 0) stack.top()->print(std::cout);
-			std::cout << "] scope {";
-			/*for (auto b : current_scope->bindings) {
-				std::cout << b.first << "=";
-				b.second->print(std::cout);
-				std::cout << " ";
-			}*/
-			std::cout << "} cur instr =";
-			code[pc]->print(std::cout);
-		}
-
-		std::shared_ptr<value> run() {
-			pc = 0;
-			while (pc < code.size()) {
-				//debug_print_state();
-				code[pc]->exec(this);
-				pc++;
+	// the operand stack, kept in one block so the JIT's machine code can push and pop ints itself
+	struct value_stack {
+		value* first = nullptr;
+		value* last = nullptr;
+		value* limit = nullptr;
+
+		value_stack() = default;
+		value_stack(const value_stack&) = delete;
+		value_stack& operator=(const value_stack&) = delete;
+		~value_stack() {
+			while (!empty()) pop();
+			::operator delete(first);
+		}
+
+		size_t size() const { return last - first; }
+		bool empty() const { return last == first; }
+		value& top() { return last[-1]; }
+		void pop() { (--last)->~value(); }
+
+		// v may be on the stack, so it is moved out of the way before growing does
+		void push(const value& v) {
+			if (last == limit) {
+				value copy = v;
+				grow();
+				new (last++) value(std::move(copy));
+			}
+			else new (last++) value(v);
+		}
+		void push(value&& v) {
+			if (last == limit) {
+				value moved = std::move(v);
+				grow();
+				new (last++) value(std::move(moved));
 			}
-			if (!stack.empty()) return stack.top();
-			else return nullptr;
+			else new (last++) value(std::move(v));
 		}
 
-		void go_to_marker(size_t marker_id, intptr_t offset = -1) {
-			for (auto i = pc; i < code.size(); ++i) {
-				auto marker = code[i]->get_marker_id();
-				if (marker.has_value() && marker.value() == marker_id) {
-					pc = i + offset;
-					return;
-				}
+		void grow() {
+			auto n = size();
+			auto capacity = first == limit ? 64 : 2 * (size_t)(limit - first);
+			auto block = (value*)::operator new(capacity * sizeof(value));
+			for (size_t i = 0; i < n; ++i) {
+				new (block + i) value(std::move(first[i]));
+				first[i].~value();
 			}
-			throw std::runtime_error("unknown marker jump");
+			::operator delete(first);
+			first = block;
+			last = block + n;
+			limit = block + capacity;
 		}
 	};
 
+	// a suspended caller: where to resume it, and where its operands start on the shared stack
+	struct frame {
+		size_t return_pc;
+		std::shared_ptr<chunk> code;
+		rc<scope> cx;
+		size_t stack_base;
+		rc<fn_value> fn;
+	};
+
+	struct interpreter {
+		rc<scope> current_scope, global_scope;
+		size_t pc; std::shared_ptr<chunk> code;
+		value_stack stack;
+		// calls push a frame instead of recursing, so the depth of bicycle recursion is
+		// not limited by the native stack
+		std::vector<frame> frames;
+		size_t stack_base;
+		// the fn being run, whose upvalues get_upvalue and set_upvalue use
+		rc<fn_value> current_fn;
+		// what the JIT's machine code last caught, for run to rethrow
+		std::exception_ptr native_error;
+
+		// how hot a chunk gets before the JIT compiles it, or 0 to always interpret
+		static inline size_t jit_threshold = 0;
+
+		interpreter(rc<scope> global_scope, std::shared_ptr<chunk> code)
+			: current_scope(global_scope), global_scope(global_scope), pc(0), code(code), stack(), stack_base(0) {}
+
+		void debug_print_state();
+
+		std::optional<value> run();
+
+	};
+
 	struct discard_instr : public instr {
 		void print(std::ostream& out) override { out << "discard" << std::endl; }
-		void exec(interpreter* intp) override {
-			if(!intp->stack.empty())intp->stack.pop();
-		}
+		void emit(assembler* as) override { as->op(opcode::discard); }
 	};
 
 	struct duplicate_instr : public instr {
 		void print(std::ostream& out) override { out << "duplicate" << std::endl; }
-		void exec(interpreter* intp) override {
-			intp->stack.push(intp->stack.top());
-		}
+		void emit(assembler* as) override { as->op(opcode::duplicate); }
 	};
 
+	// pushes a fresh copy of val, since whoever gets it may mutate it
 	struct literal_instr : public instr {
-		std::shared_ptr<value> val;
-		literal_instr(std::shared_ptr<value> v) : val(v) {}
-		void print(std::ostream& out) override { out << "literal "; val->print(out); out << std::endl; }
-		void exec(interpreter* intp) override {
-			intp->stack.push(std::shared_ptr<value>(val->clone()));
+		value val;
+		literal_instr(value v) : val(v) {}
+		void print(std::ostream& out) override { out << "literal "; val.print(out); out << std::endl; }
+		void emit(assembler* as) override {
+			as->op(opcode::literal);
+			as->operand(as->out->constants->add(val));
+		}
+	};
+
+	// pushes val itself, for values that are immutable or can't escape to be mutated
+	struct constant_instr : public instr {
+		value val;
+		constant_instr(value v) : val(v) {}
+		void print(std::ostream& out) override { out << "const "; val.print(out); out << std::endl; }
+		void emit(assembler* as) override {
+			as->op(opcode::constant);
+			as->operand(as->out->constants->add(val));
 		}
 	};
 
@@ -331,9 +976,7 @@ namespace eval {
 		std::string name;
 		get_binding_instr(const std::string& name) : name(name) {}
 		void print(std::ostream& out) override { out << "get(" << name << ")" << std::endl; }
-		void exec(interpreter* intp) override {
-			intp->stack.push(intp->current_scope->binding(name));
-		}
+		void emit(assembler* as) override { as->op(opcode::get_binding); as->operand(as->name(name)); as->cache(); }
 	};
 
 	struct get_qualified_binding_instr : public instr {
@@ -341,14 +984,23 @@ namespace eval {
 		get_qualified_binding_instr(const std::vector<std::string>& path) : path(path) {}
 		void print(std::ostream& out) override {
 			out << "get q(";
-			for (auto i = 0; i < path.size(); ++i) {
+			for (size_t i = 0; i < path.size(); ++i) {
 				out << path[i];
 				if (i + 1 < path.size()) out << "::";
 			}
 			out << ")" << std::endl;
 		}
-		void exec(interpreter* intp) override {
-			intp->stack.push(intp->current_scope->qualified_binding(path));
+		void emit(assembler* as) override {
+			as->op(opcode::get_qualified_binding);
+			operands(as);
+		}
+		// the path and cache operands, which call_qualified takes too
+		void operands(assembler* as) {
+			as->operand(as->out->paths.size());
+			std::vector<symbol> p;
+			for (auto& n : path) p.push_back(intern(n));
+			as->out->paths.push_back(p);
+			as->cache();
 		}
 	};
 
@@ -356,9 +1008,36 @@ namespace eval {
 		std::string name;
 		set_binding_instr(const std::string& name) : name(name) {}
 		void print(std::ostream& out) override { out << "set(" << name << ")" << std::endl; }
-		void exec(interpreter* intp) override {
-			intp->current_scope->binding(name, intp->stack.top());
-			intp->stack.pop();
+		void emit(assembler* as) override { as->op(opcode::set_binding); as->operand(as->name(name)); }
+	};
+
+	struct get_variable_instr : public instr {
+		std::shared_ptr<variable> var;
+		get_variable_instr(std::shared_ptr<variable> var) : var(var) {}
+		void print(std::ostream& out) override { out << "get(" << var->name << ")" << std::endl; }
+		void emit(assembler* as) override {
+			if (var->upvalue.has_value()) { as->op(opcode::get_upvalue); as->operand(var->upvalue.value()); }
+			else if (var->to != nullptr) {
+				as->op(var->to->captured[var->slot] ? opcode::get_cell : opcode::get_local);
+				as->operand(var->depth());
+				as->operand(var->slot);
+			}
+			else { as->op(opcode::get_binding); as->operand(as->name(var->name)); as->cache(); }
+		}
+	};
+
+	struct set_variable_instr : public instr {
+		std::shared_ptr<variable> var;
+		set_variable_instr(std::shared_ptr<variable> var) : var(var) {}
+		void print(std::ostream& out) override { out << "set(" << var->name << ")" << std::endl; }
+		void emit(assembler* as) override {
+			if (var->upvalue.has_value()) { as->op(opcode::set_upvalue); as->operand(var->upvalue.value()); }
+			else if (var->to != nullptr) {
+				as->op(var->to->captured[var->slot] ? opcode::set_cell : opcode::set_local);
+				as->operand(var->depth());
+				as->operand(var->slot);
+			}
+			else { as->op(opcode::set_binding); as->operand(as->name(var->name)); }
 		}
 	};
 
@@ -366,23 +1045,24 @@ namespace eval {
 		std::string name;
 		bind_instr(const std::string& name) : name(name) {}
 		void print(std::ostream& out) override { out << "bind(" << name << ")" << std::endl; }
-		void exec(interpreter* intp) override {
-			intp->current_scope->bind(name, intp->stack.top());
-			intp->stack.pop();
-		}
+		void emit(assembler* as) override { as->op(opcode::bind); as->operand(as->name(name)); }
 	};
 
 	struct enter_scope_instr : public instr {
-		void exec(interpreter* intp) override {
-			intp->current_scope = std::make_shared<scope>(intp->current_scope);
+		// the block this enters, for scopes the analyzer gives slots to
+		std::shared_ptr<lexical_scope> block;
+		enter_scope_instr(std::shared_ptr<lexical_scope> block = nullptr) : block(block) {}
+		void emit(assembler* as) override {
+			if (block == nullptr) as->op(opcode::enter_scope);
+			else if (block->exists()) { as->op(opcode::enter_block); as->operand(block->locals.size()); }
 		}
 		void print(std::ostream& out) override { out << "scope [" << std::endl; }
 	};
 
 	struct exit_scope_instr : public instr {
-		void exec(interpreter* intp) override {
-			intp->current_scope = intp->current_scope->parent;
-		}
+		std::shared_ptr<lexical_scope> block;
+		exit_scope_instr(std::shared_ptr<lexical_scope> block = nullptr) : block(block) {}
+		void emit(assembler* as) override { if (block == nullptr || block->exists()) as->op(opcode::exit_scope); }
 		void print(std::ostream& out) override { out << "] end scope" << std::endl; }
 	};
 
@@ -391,131 +1071,240 @@ namespace eval {
 
 		exit_scope_as_new_module_instr(std::string name) : name(name) {}
 
-		void exec(interpreter* intp) override {
-			auto parent = intp->current_scope->parent;
-			auto exm = parent->modules.find(name);
-			if (exm != parent->modules.end()) {
-				exm->second->bindings.insert(intp->current_scope->bindings.begin(),
-					intp->current_scope->bindings.end());
-				exm->second->modules.insert(intp->current_scope->modules.begin(),
-					intp->current_scope->modules.end());
-			}
-			else parent->modules[name] = intp->current_scope;
-			intp->current_scope = parent;
-		}
+		void emit(assembler* as) override { as->op(opcode::exit_scope_as_new_module); as->operand(as->name(name)); }
 		void print(std::ostream& out) override { out << "] new module(" << name << ")" << std::endl; }
 	};
 
 
 	struct if_abs_instr : public instr {
 		size_t true_branch, false_branch;
-		if_abs_instr(size_t t, size_t f) : true_branch(t), false_branch(f) {}
-		void exec(interpreter* intp) override {
-			auto val = intp->stack.top();
-			auto cond = std::dynamic_pointer_cast<bool_value>(val); intp->stack.pop();
-			if (cond->value) {
-				intp->pc = true_branch - 1;
-			}
-			else {
-				intp->pc = false_branch - 1;
-			}
+		// branch on the result of this op on the top two values, without pushing it
+		std::optional<op_type> op;
+		if_abs_instr(size_t t, size_t f, std::optional<op_type> op = std::nullopt) : true_branch(t), false_branch(f), op(op) {}
+		void emit(assembler* as) override {
+			if (op.has_value()) { as->op(opcode::if_bin_op); as->operand((size_t)op.value()); }
+			else as->op(opcode::if_abs);
+			as->target(true_branch);
+			as->target(false_branch);
+		}
+		void retarget(const std::function<size_t(size_t)>& f) override {
+			true_branch = f(true_branch);
+			false_branch = f(false_branch);
+		}
+		void print(std::ostream& out) override {
+			out << "ifa ";
+			if (op.has_value()) { ast::print_op(op.value(), out); out << " "; }
+			out << "then " << true_branch << " else " << false_branch << std::endl;
 		}
-		void print(std::ostream& out) override { out << "ifa then " << true_branch << " else " << false_branch << std::endl; }
 	};
 
 	struct if_instr : public instr {
 		size_t true_branch, false_branch;
-		if_instr(size_t t, size_t f) : true_branch(t), false_branch(f) {}
-		void exec(interpreter* intp) override {
-			auto val = intp->stack.top();
-			auto cond = std::dynamic_pointer_cast<bool_value>(val); intp->stack.pop();
-			if (cond->value) {
-				intp->go_to_marker(true_branch);
-			}
-			else {
-				intp->go_to_marker(false_branch);
-			}
-		}
+		std::optional<op_type> op;
+		if_instr(size_t t, size_t f, std::optional<op_type> op = std::nullopt) : true_branch(t), false_branch(f), op(op) {}
+		void emit(assembler* as) override { throw std::runtime_error("marker jump must be linked before assembly"); }
 		void print(std::ostream& out) override { out << "if then " << true_branch << " else " << false_branch << std::endl; }
 	};
 
 	struct bin_op_instr : public instr {
 		op_type op;
 		bin_op_instr(op_type op) : op(op) {}
-		void exec(interpreter* intp) override {
-			auto& stack = intp->stack;
-			if (op <= op_type::div) { // math ops
-				auto b = std::dynamic_pointer_cast<int_value>(stack.top())->value; stack.pop();
-				auto a = std::dynamic_pointer_cast<int_value>(stack.top())->value; stack.pop();
-				auto value = 0;
-				switch (op) {
-				case op_type::add: value = a + b; break;
-				case op_type::sub: value = a - b; break;
-				case op_type::mul: value = a * b; break;
-				case op_type::div: value = a / b; break;
-				default: throw std::runtime_error("unknown op");
-				}
-				stack.push(std::make_shared<int_value>(value));
+		void emit(assembler* as) override { as->op(opcode::bin_op); as->operand((size_t)op); }
+		void print(std::ostream& out) override { out << "bin op "; ast::print_op(op, out); out << std::endl; }
+	};
+
+	// var op k, with var a local that usually lives in a slot
+	struct bin_op_local_const_instr : public instr {
+		op_type op;
+		std::shared_ptr<variable> var;
+		value k;
+		bin_op_local_const_instr(op_type op, std::shared_ptr<variable> var, value k) : op(op), var(var), k(k) {}
+		void emit(assembler* as) override {
+			if (!var->in_slot()) {
+				get_variable_instr(var).emit(as);
+				constant_instr(k).emit(as);
+				bin_op_instr(op).emit(as);
+				return;
 			}
-			else if (op == op_type::eq || op == op_type::neq) {
-				auto b = stack.top(); stack.pop();
-				auto a = stack.top(); stack.pop();
-				auto value = a->equal(b);
-				if (op == op_type::neq) value = !value;
-				stack.push(std::make_shared<bool_value>(value));
+			as->op(opcode::bin_op_local_const);
+			as->operand(var->depth());
+			as->operand(var->slot);
+			as->operand(as->out->constants->add(k));
+			as->operand((size_t)op);
+		}
+		void print(std::ostream& out) override { out << "bin op " << var->name << " "; ast::print_op(op, out); out << " "; k.print(out); out << std::endl; }
+	};
+
+	// a op b, with a and b locals that usually live in slots
+	struct bin_op_locals_instr : public instr {
+		op_type op;
+		std::shared_ptr<variable> a, b;
+		bin_op_locals_instr(op_type op, std::shared_ptr<variable> a, std::shared_ptr<variable> b) : op(op), a(a), b(b) {}
+		void emit(assembler* as) override {
+			if (!a->in_slot() || !b->in_slot()) {
+				get_variable_instr(a).emit(as);
+				get_variable_instr(b).emit(as);
+				bin_op_instr(op).emit(as);
+				return;
 			}
-			else if (op <= op_type::greater_eq) { // compare ops
-			 // for now, we can only compare ints
-				auto b = std::dynamic_pointer_cast<int_value>(stack.top())->value; stack.pop();
-				auto a = std::dynamic_pointer_cast<int_value>(stack.top())->value; stack.pop();
-				auto value = false;
-				switch (op) {
-				case op_type::less: value = a < b; break;
-				case op_type::less_eq: value = a <= b; break;
-				case op_type::greater: value = a > b; break;
-				case op_type::greater_eq: value = a >= b; break;
-				default: throw std::runtime_error("unknown op");
-				}
-				stack.push(std::make_shared<bool_value>(value));
+			as->op(opcode::bin_op_locals);
+			as->operand(a->depth());
+			as->operand(a->slot);
+			as->operand(b->depth());
+			as->operand(b->slot);
+			as->operand((size_t)op);
+		}
+		void print(std::ostream& out) override { out << "bin op " << a->name << " "; ast::print_op(op, out); out << " " << b->name << std::endl; }
+	};
+
+	// var = var + delta
+	struct add_local_instr : public instr {
+		std::shared_ptr<variable> var;
+		intptr_t delta;
+		add_local_instr(std::shared_ptr<variable> var, intptr_t delta) : var(var), delta(delta) {}
+		void emit(assembler* as) override {
+			if (!var->in_slot()) {
+				get_variable_instr(var).emit(as);
+				constant_instr(value(delta)).emit(as);
+				bin_op_instr(op_type::add).emit(as);
+				set_variable_instr(var).emit(as);
+				return;
 			}
-			else if (op == op_type::and_l || op == op_type::or_l) {
-				auto b = std::dynamic_pointer_cast<bool_value>(stack.top())->value; stack.pop();
-				auto a = std::dynamic_pointer_cast<bool_value>(stack.top())->value; stack.pop();
-				auto value = false;
-				switch (op) {
-				case op_type::and_l: value = a && b; break;
-				case op_type::or_l:  value = a || b; break;
-				default: throw std::runtime_error("unknown op");
-				}
-				stack.push(std::make_shared<bool_value>(value));
+			as->op(opcode::add_local);
+			as->operand(var->depth());
+			as->operand(var->slot);
+			as->operand(as->out->constants->add(value(delta)));
+		}
+		void print(std::ostream& out) override { out << "add " << var->name << " " << delta << std::endl; }
+	};
+
+	// an operand of the register instructions: a local, or a constant if var is null
+	struct reg_operand {
+		std::shared_ptr<variable> var;
+		value k;
+
+		bool in_slot() const { return var == nullptr || var->in_slot(); }
+		// as the two operand words of a register instruction
+		void emit(assembler* as) const {
+			if (var == nullptr) { as->operand(reg_constant); as->operand(as->out->constants->add(k)); }
+			else { as->operand(var->depth()); as->operand(var->slot); }
+		}
+		// or pushed, for the stack instructions a register instruction falls back to
+		void push(assembler* as) const {
+			if (var == nullptr) constant_instr(k).emit(as);
+			else get_variable_instr(var).emit(as);
+		}
+		void print(std::ostream& out) const {
+			if (var == nullptr) k.print(out);
+			else out << var->name;
+		}
+	};
+
+	// dst = src
+	struct move_instr : public instr {
+		std::shared_ptr<variable> dst;
+		reg_operand src;
+		move_instr(std::shared_ptr<variable> dst, reg_operand src) : dst(dst), src(src) {}
+		void emit(assembler* as) override {
+			if (!dst->in_slot() || !src.in_slot()) {
+				src.push(as);
+				set_variable_instr(dst).emit(as);
+				return;
 			}
-			else throw std::runtime_error("unexpected op");
+			as->op(opcode::move);
+			as->operand(dst->depth());
+			as->operand(dst->slot);
+			src.emit(as);
 		}
-		void print(std::ostream& out) override { out << "bin op "; ast::print_op(op, out); out << std::endl; }
+		void print(std::ostream& out) override { out << "move " << dst->name << " "; src.print(out); out << std::endl; }
 	};
 
-	struct log_not_instr : public instr {
-		void exec(interpreter* intrp) override {
-			auto a = std::dynamic_pointer_cast<bool_value>(intrp->stack.top()); intrp->stack.pop();
-			intrp->stack.push(std::make_shared<bool_value>(!a->value));
+	// dst = a op b
+	struct bin_op_reg_instr : public instr {
+		op_type op;
+		std::shared_ptr<variable> dst;
+		reg_operand a, b;
+		bin_op_reg_instr(op_type op, std::shared_ptr<variable> dst, reg_operand a, reg_operand b) : op(op), dst(dst), a(a), b(b) {}
+		void emit(assembler* as) override {
+			if (!dst->in_slot() || !a.in_slot() || !b.in_slot()) {
+				a.push(as);
+				b.push(as);
+				bin_op_instr(op).emit(as);
+				set_variable_instr(dst).emit(as);
+				return;
+			}
+			as->op(opcode::bin_op_reg);
+			as->operand(dst->depth());
+			as->operand(dst->slot);
+			a.emit(as);
+			b.emit(as);
+			as->operand((size_t)op);
+		}
+		void print(std::ostream& out) override {
+			out << "bin op " << dst->name << " = ";
+			a.print(out); out << " "; ast::print_op(op, out); out << " "; b.print(out);
+			out << std::endl;
+		}
+	};
+
+	// branch on a op b
+	struct if_reg_abs_instr : public instr {
+		size_t true_branch, false_branch;
+		op_type op;
+		reg_operand a, b;
+		if_reg_abs_instr(size_t t, size_t f, op_type op, reg_operand a, reg_operand b)
+			: true_branch(t), false_branch(f), op(op), a(a), b(b) {}
+		void emit(assembler* as) override {
+			if (!a.in_slot() || !b.in_slot()) {
+				a.push(as);
+				b.push(as);
+				if_abs_instr(true_branch, false_branch, op).emit(as);
+				return;
+			}
+			as->op(opcode::if_bin_op_reg);
+			a.emit(as);
+			b.emit(as);
+			as->operand((size_t)op);
+			as->target(true_branch);
+			as->target(false_branch);
 		}
+		void retarget(const std::function<size_t(size_t)>& f) override {
+			true_branch = f(true_branch);
+			false_branch = f(false_branch);
+		}
+		void print(std::ostream& out) override {
+			out << "ifa ";
+			a.print(out); out << " "; ast::print_op(op, out); out << " "; b.print(out);
+			out << " then " << true_branch << " else " << false_branch << std::endl;
+		}
+	};
+
+	struct if_reg_instr : public instr {
+		size_t true_branch, false_branch;
+		op_type op;
+		reg_operand a, b;
+		if_reg_instr(size_t t, size_t f, op_type op, reg_operand a, reg_operand b)
+			: true_branch(t), false_branch(f), op(op), a(a), b(b) {}
+		void emit(assembler* as) override { throw std::runtime_error("marker jump must be linked before assembly"); }
+		void print(std::ostream& out) override { out << "if then " << true_branch << " else " << false_branch << std::endl; }
+	};
+
+	struct log_not_instr : public instr {
+		void emit(assembler* as) override { as->op(opcode::log_not); }
 		void print(std::ostream& out) override { out << "notl" << std::endl; }
 	};
 
 	struct jump_instr : public instr {
 		size_t loc;
 		jump_instr(size_t loc) : loc(loc) {}
-		void exec(interpreter* intp) override {
-			intp->pc = loc - 1;
-		}
+		void emit(assembler* as) override { as->op(opcode::jump); as->target(loc); }
+		void retarget(const std::function<size_t(size_t)>& f) override { loc = f(loc); }
 		void print(std::ostream& out) override { out << "jmp " << loc << std::endl; }
 	};
 	struct jump_to_marker_instr : public instr {
 		size_t id;
 		jump_to_marker_instr(size_t id) : id(id) {}
-		void exec(interpreter* intp) {
-			intp->go_to_marker(id);
-		}
+		void emit(assembler* as) override { throw std::runtime_error("marker jump must be linked before assembly"); }
 		void print(std::ostream& out) override { out << "jmp mark " << id << std::endl; }
 	};
 
@@ -523,9 +1312,12 @@ namespace eval {
 		std::optional<std::string> name;
 		std::vector<std::string> arg_names;
 		std::vector<std::shared_ptr<instr>> body;
+		// the scope of the fn's arguments, for fns the analyzer compiled
+		std::shared_ptr<lexical_scope> fn;
 		make_closure_instr(const std::vector<std::string>& arg_names, 
-			const std::vector<std::shared_ptr<instr>>& body, std::optional<std::string> name = std::nullopt)
-			: arg_names(arg_names), body(body), name(name) {}
+			const std::vector<std::shared_ptr<instr>>& body, std::optional<std::string> name = std::nullopt,
+			std::shared_ptr<lexical_scope> fn = nullptr)
+			: arg_names(arg_names), body(body), name(name), fn(fn) {}
 
 		void print(std::ostream& out) override {
 			out << "closure fn"; 
@@ -533,141 +1325,138 @@ namespace eval {
 				out << " " << name.value();
 			}
 			out << "(";
-			for (auto i = 0; i < arg_names.size(); ++i) {
+			for (size_t i = 0; i < arg_names.size(); ++i) {
 				out << arg_names[i];
 				if (i + 1 < arg_names.size()) out << ", ";
 			}
 			out << ")" << std::endl;
-			for (auto i = 0; i < body.size(); ++i) {
+			for (size_t i = 0; i < body.size(); ++i) {
 				out << i << "\t";
 				body[i]->print(out);
 			}
 			out << std::endl;
 		}
-		void exec(interpreter* intp) override {
-			intp->stack.push(std::make_shared<fn_value>(arg_names, body, intp->current_scope, name));
+		void emit(assembler* as) override {
+			as->op(opcode::make_closure);
+			as->operand(as->out->fns.size());
+			auto code = eval::assemble(body, as->out->constants);
+			if (fn == nullptr) as->out->fns.push_back(std::make_shared<fn_proto>(arg_names, code, name));
+			else as->out->fns.push_back(std::make_shared<fn_proto>(arg_names, code, name, true, fn->locals.size(), captures()));
 		}
+		// how make_closure finds each of the fn's upvalues
+		std::vector<capture> captures();
 	};
 
 	struct call_instr : public instr {
 		size_t num_args;
-
-		call_instr(size_t xar) : num_args(xar) {}
-
-		void exec(interpreter* intp) override {
-			auto fn = std::dynamic_pointer_cast<fn_value>(intp->stack.top()); intp->stack.pop();
-			//if(fn->name.has_value()) std::cout << "call to " << fn->name.value() << std::endl;
-			auto fncx = std::make_shared<scope>(fn->closure == nullptr ? intp->global_scope : fn->closure);
-			if (num_args != fn->arg_names.size()) {
-				throw std::runtime_error("expected " + std::to_string(fn->arg_names.size()) +
-					" arguments but only got " + std::to_string(num_args));
-			}
-			for (auto an : fn->arg_names) {
-				if (intp->stack.empty())
-					throw std::runtime_error("expected more arguments for fn call, stack bottomed out");
-				fncx->bind(an, intp->stack.top()); intp->stack.pop();
+		// the call's value is returned right away, so the callee can take over the caller's frame
+		bool tail;
+		// what pushes the fn, if the analyzer left it to the call so a lookup by name can be
+		// done by the call itself
+		std::shared_ptr<instr> callee;
+
+		call_instr(size_t xar, bool tail = false) : num_args(xar), tail(tail) {}
+
+		void emit(assembler* as) override {
+			if (!tail) {
+				auto v = std::dynamic_pointer_cast<get_variable_instr>(callee);
+				if (v != nullptr && !v->var->upvalue.has_value() && v->var->to == nullptr) {
+					as->op(opcode::call_binding);
+					as->operand(num_args);
+					as->operand(as->name(v->var->name));
+					as->cache();
+					return;
+				}
+				if (auto q = std::dynamic_pointer_cast<get_qualified_binding_instr>(callee)) {
+					as->op(opcode::call_qualified);
+					as->operand(num_args);
+					q->operands(as);
+					return;
+				}
 			}
-			interpreter fn_intp(fncx, fn->body);
-			auto rv = fn_intp.run();
-			if (rv != nullptr) intp->stack.push(rv);
+			if (callee != nullptr) callee->emit(as);
+			as->op(tail ? opcode::tail_call : opcode::call);
+			as->operand(num_args);
+		}
+		void print(std::ostream& out) override {
+			if (callee != nullptr) callee->print(out);
+			out << (tail ? "tail call" : "call") << std::endl;
 		}
-		void print(std::ostream& out) override { out << "call" << std::endl; }
 	};
 
 	struct ret_instr : public instr {
-		void exec(interpreter* intp) override {
-			intp->pc = intp->code.size() + 1;
-		}
+		void emit(assembler* as) override { as->op(opcode::ret); }
 		void print(std::ostream& out) override { out << "ret" << std::endl; }
 	};
 
 	struct get_index_instr : public instr {
-		void exec(interpreter* intp) override {
-			auto ix = intp->stack.top(); intp->stack.pop();
-			auto top = intp->stack.top(); intp->stack.pop();
-			auto list = std::dynamic_pointer_cast<list_value>(top);
-			if (list != nullptr) {
-				auto i = std::dynamic_pointer_cast<int_value>(ix);
-				if (i == nullptr) throw std::runtime_error("expected int index to list");
-				intp->stack.push(list->values[i->value]);
-				return;
-			}
-			auto map = std::dynamic_pointer_cast<map_value>(top);
-			if (map != nullptr) {
-				auto n = std::dynamic_pointer_cast<str_value>(ix);
-				if (n == nullptr) throw std::runtime_error("expected string key");
-				intp->stack.push(map->values[n->value]);
-				return;
-			}
-			auto str = std::dynamic_pointer_cast<str_value>(top);
-			if (str != nullptr) {
-				auto i = std::dynamic_pointer_cast<int_value>(ix);
-				if (i == nullptr) throw std::runtime_error("expected int index to string");
-				intp->stack.push(std::make_shared<int_value>(str->value[i->value]));
-				return;
-			}
-			throw std::runtime_error("attempted to index unindexable value");
-		}
+		void emit(assembler* as) override { as->op(opcode::get_index); }
 		void print(std::ostream& out) override { out << "index" << std::endl; }
 	};
 
 	struct set_index_instr : public instr {
-		void exec(interpreter* intp) override {
-			auto v = intp->stack.top(); intp->stack.pop();
-			auto ix = intp->stack.top(); intp->stack.pop();
-			auto col = intp->stack.top(); intp->stack.pop();
-			auto list = std::dynamic_pointer_cast<list_value>(col);
-			if (list != nullptr) {
-				auto i = std::dynamic_pointer_cast<int_value>(ix);
-				if (i == nullptr) throw std::runtime_error("expected int index to list");
-				list->values[i->value] = v;
-				return;
-			}
-			auto map = std::dynamic_pointer_cast<map_value>(col);
-			if (map != nullptr) {
-				auto n = std::dynamic_pointer_cast<str_value>(ix);
-				if (n == nullptr) throw std::runtime_error("expected string key");
-				map->values[n->value] = v;
-				return;
-			}
-			throw std::runtime_error("attempted to index unindexable value");
-		}
+		void emit(assembler* as) override { as->op(opcode::set_index); }
 		void print(std::ostream& out) override { out << "set index" << std::endl; }
 	};
 
 	struct append_list_instr : public instr {
-		void exec(interpreter* intp) override {
-			auto v = intp->stack.top(); intp->stack.pop();
-			auto list = std::dynamic_pointer_cast<list_value>(intp->stack.top());
-			list->values.push_back(v);
-		}
+		void emit(assembler* as) override { as->op(opcode::append_list); }
 		void print(std::ostream& out) override { out << "append" << std::endl; }
 	};
 
 	struct get_key_instr : public instr {
-		void exec(interpreter* intp) override {
-			auto n = std::dynamic_pointer_cast<str_value>(intp->stack.top()); intp->stack.pop();
-			if (n == nullptr)
-				throw std::runtime_error("expected string key");
-			auto map = std::dynamic_pointer_cast<map_value>(intp->stack.top()); intp->stack.pop();
-			auto val = map->values.find(n->value);
-			intp->stack.push(val == map->values.end() ? std::make_shared<nil_value>() : val->second);
-		}
+		void emit(assembler* as) override { as->op(opcode::get_key); }
 		void print(std::ostream& out) override { out << "get key" << std::endl; }
 	};
 
 	struct set_key_instr : public instr {
-		void exec(interpreter* intp) override {
-			auto v = intp->stack.top(); intp->stack.pop();
-			auto n = std::dynamic_pointer_cast<str_value>(intp->stack.top()); intp->stack.pop();
-			if (n == nullptr)
-				throw std::runtime_error("expected string key");
-			auto map = std::dynamic_pointer_cast<map_value>(intp->stack.top());
-			map->values[n->value] = v;
-		}
+		void emit(assembler* as) override { as->op(opcode::set_key); }
 		void print(std::ostream& out) override { out << "set key" << std::endl; }
 	};
 
+	// get key and set key with a key known when compiling, as in a.b
+	struct get_field_instr : public instr {
+		std::string key;
+		get_field_instr(const std::string& key) : key(key) {}
+		void emit(assembler* as) override {
+			as->op(opcode::get_field);
+			as->operand(as->out->constants->add(make_rc<str_value>(key)));
+			as->field_cache();
+		}
+		void print(std::ostream& out) override { out << "get field " << key << std::endl; }
+	};
+
+	// var.key, with var a local that usually lives in a slot
+	struct get_local_field_instr : public instr {
+		std::shared_ptr<variable> var;
+		std::string key;
+		get_local_field_instr(std::shared_ptr<variable> var, const std::string& key) : var(var), key(key) {}
+		void emit(assembler* as) override {
+			if (!var->in_slot()) {
+				get_variable_instr(var).emit(as);
+				get_field_instr(key).emit(as);
+				return;
+			}
+			as->op(opcode::get_local_field);
+			as->operand(var->depth());
+			as->operand(var->slot);
+			as->operand(as->out->constants->add(make_rc<str_value>(key)));
+			as->field_cache();
+		}
+		void print(std::ostream& out) override { out << "get field " << var->name << "." << key << std::endl; }
+	};
+
+	struct set_field_instr : public instr {
+		std::string key;
+		set_field_instr(const std::string& key) : key(key) {}
+		void emit(assembler* as) override {
+			as->op(opcode::set_field);
+			as->operand(as->out->constants->add(make_rc<str_value>(key)));
+			as->field_cache();
+		}
+		void print(std::ostream& out) override { out << "set field " << key << std::endl; }
+	};
+
 	struct system_instr : public instr {
 		std::function<void(interpreter*)> f;
 
@@ -680,31 +1469,103 @@ namespace eval {
 			out << "system" << std::endl;
 		}
 
-		virtual void exec(interpreter* intrp) override {
-			f(intrp);
+		virtual void emit(assembler* as) override {
+			as->op(opcode::system);
+			as->operand(as->out->natives.size());
+			as->out->natives.push_back(f);
 		}
 
 	};
 
-	std::vector<std::shared_ptr<eval::instr>> load_and_assemble(const std::filesystem::path& path);
+	// resolve marker jumps to instruction indices and drop the markers
+	std::vector<std::shared_ptr<instr>> link(const std::vector<std::shared_ptr<instr>>& code);
+	// append linked code to dst, moving its jump targets along with it
+	void splice(std::vector<std::shared_ptr<instr>>& dst, const std::vector<std::shared_ptr<instr>>& code);
+	// peephole pass over linked code: drop values pushed only to be discarded, scopes
+	// nothing is bound in and unreachable code, and thread jumps through jumps
+	std::vector<std::shared_ptr<instr>> optimize(const std::vector<std::shared_ptr<instr>>& code);
+
+	// what the analyzer knows about a whole program (a file and every file it includes)
+	// before it analyzes any of it, so that module-level constants can be propagated
+	struct program_info {
+		// how many times each name is declared, by let, fn or as an argument
+		std::map<std::string, size_t> declarations;
+		// names that are assigned to somewhere
+		std::set<std::string> assigned;
+		std::set<std::filesystem::path> files;
+		// a file that doesn't parse may hide assignments, and so may the REPL, so then
+		// nothing is propagated
+		bool complete = true;
+		// the constant module-level lets analyzed so far, by module path and name
+		std::map<std::vector<std::string>, value> constants;
+
+		// add a file, and the files it includes
+		void scan(const std::filesystem::path& path);
+		// whether the only binding of a name is the one let that declares it
+		bool never_rebound(const std::string& name) const {
+			auto d = declarations.find(name);
+			return complete && d != declarations.end() && d->second == 1 && assigned.find(name) == assigned.end();
+		}
+	};
+
+	std::vector<std::shared_ptr<eval::instr>> load_and_assemble(const std::filesystem::path& path,
+		std::shared_ptr<program_info> program = nullptr, std::vector<std::string> module_path = {});
 
 	class analyzer : public ast::stmt_visitor, public ast::expr_visitor {
 
 		std::vector<std::string>* ids;
 		std::vector<std::shared_ptr<instr>> instrs;
 		size_t next_marker;
-		// (name, start - location, end - marker)
-		std::vector<std::tuple<std::optional<size_t>, size_t, size_t>> loop_marker_stack;
+		// (name, start - location, end - marker, scope the loop is in)
+		std::vector<std::tuple<std::optional<size_t>, size_t, size_t, std::shared_ptr<lexical_scope>>> loop_marker_stack;
 		std::filesystem::path root_path;
+		std::shared_ptr<lexical_scope> env;
 
 		inline size_t new_marker() { return ++next_marker;  }
+		// visit an expression whose value is consumed on the spot, so a string literal
+		// there can be the shared constant instead of a copy
+		void visit_operand(std::shared_ptr<ast::expression> x);
+		// uses of names that may be free variables, resolved once the whole statement is analyzed
+		std::shared_ptr<std::vector<std::shared_ptr<variable>>> free_vars;
+		std::shared_ptr<variable> resolve(const std::string& name);
+		// leave every scope entered since env was outer, for jumps out of blocks
+		void exit_scopes_to(std::shared_ptr<lexical_scope> outer);
+		// the value of an expression if it can be computed now: literals, propagated
+		// constants and operators applied to them
+		std::optional<value> fold(ast::expression* x);
+		// a propagated constant visible by this (possibly qualified) name from here
+		std::optional<value> constant(const std::vector<std::string>& path);
+		// names of the modules the code is in, outermost first
+		std::vector<std::string> module_path;
+		// whether register mode can compute an expression without the stack: a local of
+		// this fn, a constant, or an operator applied to those
+		bool in_registers(ast::expression* x);
+		// an operand for such an expression, computing operators into temporaries
+		reg_operand to_register(ast::expression* x);
+		// compute such an expression straight into the variable dst returns
+		void assign_in_registers(ast::expression* x, const std::function<std::shared_ptr<variable>()>& dst);
+		// temporaries handed out in the statement being analyzed, which the next one reuses
+		size_t next_temp = 0;
 	public:
-		analyzer(std::vector<std::string>* ids, std::filesystem::path root_path)
-			: ids(ids), instrs(), next_marker(1), root_path(root_path) {}
+		// compile lets, assignments and conditions with the register instructions where
+		// their operands allow it, set by -r
+		static inline bool registers = false;
+
+		// null when the analyzer only sees part of the program; then it doesn't propagate constants
+		std::shared_ptr<program_info> program;
+
+		analyzer(std::vector<std::string>* ids, std::filesystem::path root_path,
+			std::shared_ptr<lexical_scope> env = std::make_shared<lexical_scope>(lexical_scope::by_name, nullptr),
+			std::shared_ptr<program_info> program = nullptr, std::vector<std::string> module_path = {})
+			: ids(ids), instrs(), next_marker(1), root_path(root_path), env(env), module_path(module_path), program(program) {}
 
 		std::vector<std::shared_ptr<instr>> analyze(std::shared_ptr<ast::statement> code) {
+			// nested fns share the list of the statement they are in
+			bool outermost = free_vars == nullptr;
+			if (outermost) free_vars = std::make_shared<std::vector<std::shared_ptr<variable>>>();
 			code->visit(this);
-			return instrs;
+			if (outermost) for (auto& v : *free_vars) v->resolve_free();
+			return optimize(link(instrs));
 		}
 
 		// Inherited via stmt_visitor
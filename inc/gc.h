@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+
+namespace eval {
+	// collects cycles of nodes that reference counting alone can't free
+	namespace gc {
+		struct node;
+
+		struct tracer {
+			virtual void operator()(node* n) = 0;
+		};
+
+		struct links {
+			links* prev;
+			links* next;
+		};
+
+		// every tracked node
+		inline links all = { &all, &all };
+		inline size_t live = 0;
+		const size_t min_collection = 10000;
+		inline size_t next_collection = min_collection;
+		// how many collections have run, which programs read with gc::collections()
+		inline size_t collections = 0;
+
+		// untracked nodes, like strings, can't hold references
+		struct node : links {
+			// rcs to it
+			size_t uses = 0;
+			// rcs to it from outside the heap, worked out by collect
+			long refs = 0;
+
+			node(bool tracked = true) : links{ nullptr, nullptr } {
+				if (!tracked) return;
+				prev = all.prev;
+				next = &all;
+				all.prev->next = this;
+				all.prev = this;
+				live++;
+			}
+			node(const node& other) : node(other.prev != nullptr) {}
+			node& operator=(const node&) { return *this; }
+			virtual ~node() {
+				if (prev == nullptr) return;
+				prev->next = next;
+				next->prev = prev;
+				live--;
+			}
+
+			virtual void trace(tracer& t) {}
+			// drops every reference trace would report
+			virtual void clear() {}
+		};
+
+		inline bool due() { return live >= next_collection; }
+
+		// returns the number of nodes found to be garbage
+		size_t collect();
+
+		// called on calls and backward jumps, by the interpreter, JIT code and compiled code
+		inline void poll() { if (due()) collect(); }
+	}
+}
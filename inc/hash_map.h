@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "symbol.h"
+
+namespace eval {
+	// a map from symbols to V that iterates in insertion order. Adding an entry can move the others
+	template<typename V>
+	struct hash_map {
+		using entry = std::pair<symbol, V>;
+		using iterator = typename std::vector<entry>::iterator;
+		using const_iterator = typename std::vector<entry>::const_iterator;
+
+		static constexpr size_t small_size = 8;
+
+		iterator begin() { return entries.begin(); }
+		iterator end() { return entries.end(); }
+		const_iterator begin() const { return entries.begin(); }
+		const_iterator end() const { return entries.end(); }
+		size_t size() const { return entries.size(); }
+		bool empty() const { return entries.empty(); }
+
+		iterator find(const symbol& key) {
+			auto i = index_of(key);
+			return i == SIZE_MAX ? end() : begin() + i;
+		}
+
+		std::pair<iterator, bool> try_emplace(const symbol& key) {
+			auto i = index_of(key);
+			if (i != SIZE_MAX) return { begin() + i, false };
+			return { add(key), true };
+		}
+
+		// key must not be there yet
+		iterator add(const symbol& key) {
+			entries.emplace_back(key, V());
+			if (!table.empty() || entries.size() > small_size) add_to_table(entries.size() - 1);
+			return end() - 1;
+		}
+
+		V& operator[](const symbol& key) { return try_emplace(key).first->second; }
+
+		std::pair<iterator, bool> insert(const entry& e) {
+			auto r = try_emplace(e.first);
+			if (r.second) r.first->second = e.second;
+			return r;
+		}
+
+		std::pair<iterator, bool> insert_or_assign(const symbol& key, const V& v) {
+			auto r = try_emplace(key);
+			r.first->second = v;
+			return r;
+		}
+
+		// moves the entries after key down, so it costs O(size)
+		void erase(const symbol& key) {
+			auto i = index_of(key);
+			if (i == SIZE_MAX) return;
+			entries.erase(entries.begin() + i);
+			if (!table.empty()) {
+				table.assign(table.size(), 0);
+				for (size_t j = 0; j < entries.size(); ++j) place(j);
+			}
+		}
+
+		void clear() {
+			entries.clear();
+			table.clear();
+		}
+
+	private:
+		std::vector<entry> entries;
+		// entry index + 1 per slot, probed linearly; empty while small maps are scanned instead
+		std::vector<uint32_t> table;
+
+		size_t index_of(const symbol& key) const {
+			if (table.empty()) {
+				for (size_t i = 0; i < entries.size(); ++i)
+					if (entries[i].first == key) return i;
+				return SIZE_MAX;
+			}
+			auto mask = table.size() - 1;
+			for (auto s = key->hash & mask;; s = (s + 1) & mask) {
+				auto i = table[s];
+				if (i == 0) return SIZE_MAX;
+				if (entries[i - 1].first == key) return i - 1;
+			}
+		}
+
+		void add_to_table(size_t index) {
+			if (2 * entries.size() > table.size()) {
+				auto n = table.empty() ? 4 * small_size : 2 * table.size();
+				table.assign(n, 0);
+				for (size_t i = 0; i < index; ++i) place(i);
+			}
+			place(index);
+		}
+
+		void place(size_t index) {
+			auto mask = table.size() - 1;
+			auto s = entries[index].first->hash & mask;
+			while (table[s] != 0) s = (s + 1) & mask;
+			table[s] = (uint32_t)index + 1;
+		}
+	};
+}
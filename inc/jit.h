@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// the JIT writes x86-64 machine code and uses the System V calling convention and mmap,
+// so it only exists on x86-64 Linux. Everywhere else chunks are always interpreted
+#if defined(__x86_64__) && defined(__linux__)
+#define BICYCLE_JIT
+#endif
+
+namespace eval {
+	struct chunk;
+	struct interpreter;
+	enum class opcode : uint32_t;
+
+	// machine code for a chunk, from the JIT or compiled ahead of time by bicycle_aot.
+	// Calls, returns and natives are left to the interpreter: the machine code hands back
+	// the offset of the instruction it stopped at, and the interpreter carries on from there
+	struct native_code {
+		typedef size_t (*entry_fn)(interpreter* in, size_t pc);
+
+		entry_fn entry;
+		// the JIT's mapping, which the machine code lives in, or nullptr
+		void* memory = nullptr;
+		size_t size = 0;
+		// the JIT's machine code for each offset in the chunk's code that starts an
+		// instruction, plus one past the end
+		std::vector<void*> entries;
+
+		native_code(entry_fn entry) : entry(entry) {}
+		// maps size bytes for the JIT to write to
+		native_code(size_t size);
+		~native_code();
+
+		// runs from the instruction at pc and returns where the interpreter should pick up,
+		// or jit::failed if an instruction threw in JIT code, in which case the exception
+		// is in interpreter::native_error
+		size_t run(interpreter* in, size_t pc) { return entry(in, pc); }
+	};
+
+	// a baseline JIT. A chunk that gets hot is translated instruction by instruction into
+	// machine code that calls a stub for each instruction, so nothing is left of dispatch
+	// but direct calls and direct jumps. The int and local instructions have templates that
+	// do them inline on the stack and slots, and only call the stub for anything but ints
+	namespace jit {
+		const size_t failed = SIZE_MAX;
+		// how many calls or loop iterations a chunk gets before it is compiled, if -j is given
+		const size_t default_threshold = 100;
+
+		// a stub does one instruction: it returns 0 to go on (or take the false branch),
+		// 1 to take the true branch and 2 if the instruction threw
+		typedef int (*stub)(interpreter* in, uint32_t* instr);
+
+		// the stub for an instruction, or nullptr for the ones only the interpreter can run
+		stub stub_for(opcode op, bool& branch);
+
+		// nullptr if there's nothing in the chunk worth compiling
+		std::shared_ptr<native_code> compile(chunk& c);
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <ostream>
+#include "eval.h"
+
+namespace eval {
+	// reads the .bcc files the self-hosted compiler writes, pulling in the files of the
+	// modules they include from the same directory
+	struct loader {
+		// where the bytes of a file come from, the disk unless something else is given
+		std::function<std::vector<uint8_t>(const std::filesystem::path&)> read;
+		// if set, the raw bytes and the loaded instructions are dumped here
+		std::ostream* trace;
+
+		loader(std::ostream* trace = nullptr);
+
+		// prints the error and exits if the file can't be loaded
+		std::vector<std::shared_ptr<instr>> load_file(const std::filesystem::path& path);
+		std::vector<std::shared_ptr<instr>> load_code(char*& buf, const std::filesystem::path& root_path);
+	};
+
+	std::vector<uint8_t> read_file(const std::filesystem::path& path);
+}
@@ -0,0 +1,466 @@
+#pragma once
+
+#include "eval.h"
+
+// the ops bin_op and if_bin_op are quickened for, as (name, C++ operator)
+#define BICYCLE_QUICK_BRANCHES(X) \
+	X(eq, ==) X(neq, !=) X(less, <) X(greater, >) X(less_eq, <=) X(greater_eq, >=)
+#define BICYCLE_QUICK_OPS(X) \
+	X(add, +) X(sub, -) X(mul, *) BICYCLE_QUICK_BRANCHES(X)
+
+// instructions that always go on to the next one and only touch the stack and scopes
+#define BICYCLE_SIMPLE_OPS(X) \
+	X(discard) X(duplicate) X(literal) X(constant) X(get_binding) X(get_qualified_binding) \
+	X(set_binding) X(bind) X(enter_scope) X(exit_scope) X(enter_block) X(get_local) X(set_local) \
+	X(exit_scope_as_new_module) X(bin_op) X(bin_op_local_const) X(bin_op_locals) X(add_local) X(log_not) \
+	X(make_closure) X(get_cell) X(set_cell) X(get_upvalue) X(set_upvalue) X(get_index) \
+	X(set_index) X(append_list) X(get_key) X(set_key) X(get_field) X(get_local_field) X(set_field) \
+	X(move) X(bin_op_reg)
+
+// instructions that pop a condition and go to one of two targets
+#define BICYCLE_BRANCH_OPS(X) X(if_abs) X(if_bin_op) X(if_bin_op_reg)
+
+// run is one huge function, so the compiler has to be told to inline the small ops that
+// run all the time; inlining everything leaves it too big to optimize
+#if defined(__GNUC__)
+#define BICYCLE_HOT_OP inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define BICYCLE_HOT_OP __forceinline
+#else
+#define BICYCLE_HOT_OP inline
+#endif
+
+namespace eval {
+	// the quickened form of bin_op for two ints, or bin_op itself if there is none
+	inline opcode int_form(op_type op) {
+		switch (op) {
+#define X(name, oper) case op_type::name: return opcode::name##_int;
+		BICYCLE_QUICK_OPS(X)
+#undef X
+		default: return opcode::bin_op;
+		}
+	}
+
+	inline opcode int_branch_form(op_type op) {
+		switch (op) {
+#define X(name, oper) case op_type::name: return opcode::if_##name##_int;
+		BICYCLE_QUICK_BRANCHES(X)
+#undef X
+		default: return opcode::if_bin_op;
+		}
+	}
+
+	// the size of each instruction in words, as constants for run to step pc by
+	namespace width {
+#define X(name, code, operands) const size_t name = 1 + operands;
+		BICYCLE_OPCODES(X)
+#undef X
+	}
+
+	// what the simple and branch instructions do, shared by the dispatch loop in run, the
+	// JIT's stubs and the C++ bicycle_aot writes. i points at the opcode, so the operands
+	// are i[1], i[2]...; branches return which way to go
+	namespace ops {
+		// run on a jump backwards, which closes a loop, before jumping
+		inline void loop_back(interpreter& in, uint32_t* i) { gc::poll(); }
+
+		BICYCLE_HOT_OP void discard(interpreter& in, uint32_t* i) {
+			if (in.stack.size() > in.stack_base) in.stack.pop();
+		}
+
+		BICYCLE_HOT_OP void duplicate(interpreter& in, uint32_t* i) {
+			in.stack.push(in.stack.top());
+		}
+
+		BICYCLE_HOT_OP void literal(interpreter& in, uint32_t* i) {
+			in.stack.push(in.code->constants->values[i[1]].clone());
+		}
+
+		BICYCLE_HOT_OP void constant(interpreter& in, uint32_t* i) {
+			in.stack.push(in.code->constants->values[i[1]]);
+		}
+
+		// names is the sum of the versions of the names looked up, which only grows
+		BICYCLE_HOT_OP bool cache_hit(const binding_cache& ic, scope* from, size_t names) {
+			auto s = from;
+			while (s->id >= ic.stamp && s->id != ic.anchor && s->parent != nullptr) s = s->parent.get();
+			return s->id == ic.anchor && ic.names == names && ic.holder->version == ic.holder_version;
+		}
+
+		inline void fill_cache(binding_cache& ic, scope* from, size_t names, scope* holder, const value* cell) {
+			// anchor on the first scope the last lookup saw too, so that scopes made per
+			// iteration or per call get skipped from the next lookup on
+			auto a = from;
+			while (a != holder && a->id >= ic.stamp) a = a->parent.get();
+			ic.anchor = a->id;
+			ic.stamp = scope::next_id;
+			ic.names = names;
+			ic.holder = holder;
+			ic.holder_version = holder->version;
+			ic.cell = cell;
+		}
+
+		// what get_binding pushes, which call_binding calls
+		BICYCLE_HOT_OP const value& cached_binding(interpreter& in, uint32_t* i) {
+			auto from = in.current_scope->named();
+			auto& ic = in.code->caches[i[2]];
+			auto& name = in.code->names[i[1]];
+			if (!cache_hit(ic, from, name->version)) {
+				scope* holder;
+				auto cell = &from->binding(name, &holder);
+				fill_cache(ic, from, name->version, holder, cell);
+			}
+			return *ic.cell;
+		}
+
+		BICYCLE_HOT_OP void get_binding(interpreter& in, uint32_t* i) {
+			in.stack.push(cached_binding(in, i));
+		}
+
+		BICYCLE_HOT_OP const value& cached_qualified_binding(interpreter& in, uint32_t* i) {
+			auto from = in.current_scope->named();
+			auto& ic = in.code->caches[i[2]];
+			auto& path = in.code->paths[i[1]];
+			size_t names = 0;
+			for (auto& p : path) names += p->version;
+			if (!cache_hit(ic, from, names)) {
+				scope* holder;
+				auto cell = &from->qualified_binding(path, 0, &holder);
+				fill_cache(ic, from, names, holder, cell);
+			}
+			return *ic.cell;
+		}
+
+		BICYCLE_HOT_OP void get_qualified_binding(interpreter& in, uint32_t* i) {
+			in.stack.push(cached_qualified_binding(in, i));
+		}
+
+		inline void set_binding(interpreter& in, uint32_t* i) {
+			in.current_scope->binding(in.code->names[i[1]], in.stack.top());
+			in.stack.pop();
+		}
+
+		inline void bind(interpreter& in, uint32_t* i) {
+			in.current_scope->bind(in.code->names[i[1]], in.stack.top());
+			in.stack.pop();
+		}
+
+		inline void enter_scope(interpreter& in, uint32_t* i) {
+			in.current_scope = scope::make(std::move(in.current_scope));
+		}
+
+		BICYCLE_HOT_OP void exit_scope(interpreter& in, uint32_t* i) {
+			in.current_scope = in.current_scope->parent;
+		}
+
+		BICYCLE_HOT_OP void enter_block(interpreter& in, uint32_t* i) {
+			in.current_scope = scope::make(std::move(in.current_scope), i[1], false);
+		}
+
+		BICYCLE_HOT_OP scope* local_scope(interpreter& in, uint32_t depth) {
+			auto s = in.current_scope.get();
+			for (auto d = depth; d > 0; --d) s = s->parent.get();
+			return s;
+		}
+
+		BICYCLE_HOT_OP void get_local(interpreter& in, uint32_t* i) {
+			in.stack.push(local_scope(in, i[1])->slots[i[2]]);
+		}
+
+		BICYCLE_HOT_OP void set_local(interpreter& in, uint32_t* i) {
+			local_scope(in, i[1])->slots[i[2]] = std::move(in.stack.top());
+			in.stack.pop();
+		}
+
+		inline void exit_scope_as_new_module(interpreter& in, uint32_t* i) {
+			auto& name = in.code->names[i[1]];
+			auto parent = in.current_scope->parent;
+			auto exm = parent->modules.find(name);
+			if (exm != parent->modules.end()) {
+				auto& into = *exm->second;
+				for (auto& b : in.current_scope->bindings)
+					if (into.bindings.insert(b).second) into.added(b.first);
+				for (auto& m : in.current_scope->modules)
+					if (into.modules.insert(m).second) into.added(m.first);
+			}
+			else parent->bind_module(name, in.current_scope);
+			in.current_scope = parent;
+		}
+
+		BICYCLE_HOT_OP bool if_abs(interpreter& in, uint32_t* i) {
+			auto cond = in.stack.top().as_bool(); in.stack.pop();
+			return cond;
+		}
+
+		inline void bin_op(interpreter& in, uint32_t* i) {
+			auto b = std::move(in.stack.top()); in.stack.pop();
+			auto a = std::move(in.stack.top()); in.stack.pop();
+			if (a.type == value_type::int_ && b.type == value_type::int_) i[0] = (uint32_t)int_form((op_type)i[1]);
+			in.stack.push(apply_bin_op((op_type)i[1], a, b));
+		}
+
+		inline bool if_bin_op(interpreter& in, uint32_t* i) {
+			auto b = std::move(in.stack.top()); in.stack.pop();
+			auto a = std::move(in.stack.top()); in.stack.pop();
+			if (a.type == value_type::int_ && b.type == value_type::int_) i[0] = (uint32_t)int_branch_form((op_type)i[1]);
+			return apply_bin_op((op_type)i[1], a, b).as_bool();
+		}
+
+		// the result replaces the left operand in place; anything but two ints goes back to bin_op
+#define X(name, oper) \
+		BICYCLE_HOT_OP void name##_int(interpreter& in, uint32_t* i) { \
+			auto b = std::move(in.stack.top()); in.stack.pop(); \
+			auto& a = in.stack.top(); \
+			if (a.type == value_type::int_ && b.type == value_type::int_) a = value(a.integer oper b.integer); \
+			else { \
+				i[0] = (uint32_t)opcode::bin_op; \
+				a = apply_bin_op((op_type)i[1], a, b); \
+			} \
+		}
+		BICYCLE_QUICK_OPS(X)
+#undef X
+
+#define X(name, oper) \
+		BICYCLE_HOT_OP bool if_##name##_int(interpreter& in, uint32_t* i) { \
+			auto b = std::move(in.stack.top()); in.stack.pop(); \
+			auto a = std::move(in.stack.top()); in.stack.pop(); \
+			if (a.type == value_type::int_ && b.type == value_type::int_) return a.integer oper b.integer; \
+			i[0] = (uint32_t)opcode::if_bin_op; \
+			return apply_bin_op((op_type)i[1], a, b).as_bool(); \
+		}
+		BICYCLE_QUICK_BRANCHES(X)
+#undef X
+
+		BICYCLE_HOT_OP void bin_op_local_const(interpreter& in, uint32_t* i) {
+			in.stack.push(apply_bin_op((op_type)i[4], local_scope(in, i[1])->slots[i[2]], in.code->constants->values[i[3]]));
+		}
+
+		BICYCLE_HOT_OP void bin_op_locals(interpreter& in, uint32_t* i) {
+			auto& a = local_scope(in, i[1])->slots[i[2]];
+			auto& b = local_scope(in, i[3])->slots[i[4]];
+			auto op = (op_type)i[5];
+			if (a.type == value_type::int_ && b.type == value_type::int_) {
+				switch (op) {
+#define X(name, oper) case op_type::name: in.stack.push(value(a.integer oper b.integer)); return;
+				BICYCLE_QUICK_OPS(X)
+#undef X
+				default: break;
+				}
+			}
+			in.stack.push(apply_bin_op(op, a, b));
+		}
+
+		BICYCLE_HOT_OP void add_local(interpreter& in, uint32_t* i) {
+			auto& slot = local_scope(in, i[1])->slots[i[2]];
+			slot = value(slot.as_int() + in.code->constants->values[i[3]].integer);
+		}
+
+		// the slot or constant a register operand at r names
+		BICYCLE_HOT_OP value& reg(interpreter& in, uint32_t* r) {
+			if (r[0] == reg_constant) return in.code->constants->values[r[1]];
+			return local_scope(in, r[0])->slots[r[1]];
+		}
+
+		BICYCLE_HOT_OP void move(interpreter& in, uint32_t* i) {
+			reg(in, i + 1) = reg(in, i + 3);
+		}
+
+		// two ints need no quickening here, since nothing has to come off the stack
+		BICYCLE_HOT_OP void bin_op_reg(interpreter& in, uint32_t* i) {
+			auto& a = reg(in, i + 3);
+			auto& b = reg(in, i + 5);
+			auto op = (op_type)i[7];
+			if (a.type == value_type::int_ && b.type == value_type::int_) {
+				switch (op) {
+#define X(name, oper) case op_type::name: reg(in, i + 1) = value(a.integer oper b.integer); return;
+				BICYCLE_QUICK_OPS(X)
+#undef X
+				default: break;
+				}
+			}
+			reg(in, i + 1) = apply_bin_op(op, a, b);
+		}
+
+		BICYCLE_HOT_OP bool if_bin_op_reg(interpreter& in, uint32_t* i) {
+			auto& a = reg(in, i + 1);
+			auto& b = reg(in, i + 3);
+			auto op = (op_type)i[5];
+			if (a.type == value_type::int_ && b.type == value_type::int_) {
+				switch (op) {
+#define X(name, oper) case op_type::name: return a.integer oper b.integer;
+				BICYCLE_QUICK_BRANCHES(X)
+#undef X
+				default: break;
+				}
+			}
+			return apply_bin_op(op, a, b).as_bool();
+		}
+
+		BICYCLE_HOT_OP void log_not(interpreter& in, uint32_t* i) {
+			auto a = in.stack.top().as_bool(); in.stack.pop();
+			in.stack.push(!a);
+		}
+
+		inline void make_closure(interpreter& in, uint32_t* i) {
+			auto& proto = in.code->fns[i[1]];
+			if (!proto->flat) {
+				in.stack.push(make_rc<fn_value>(proto, in.current_scope));
+				return;
+			}
+			auto fn = make_rc<fn_value>(proto, rc<scope>(in.current_scope->named()));
+			fn->upvalues.reserve(proto->captures.size());
+			for (auto& cp : proto->captures) {
+				if (cp.from_upvalue) {
+					fn->upvalues.push_back(in.current_fn->upvalues[cp.index]);
+					continue;
+				}
+				// the first closure to capture a slot moves its value into a cell
+				auto& slot = local_scope(in, cp.depth)->slots[cp.index];
+				auto cl = slot.as<cell>();
+				if (cl == nullptr) {
+					cl = make_rc<cell>(std::move(slot));
+					slot = value(cl);
+				}
+				fn->upvalues.push_back(std::move(cl));
+			}
+			in.stack.push(std::move(fn));
+		}
+
+		BICYCLE_HOT_OP void get_cell(interpreter& in, uint32_t* i) {
+			auto& slot = local_scope(in, i[1])->slots[i[2]];
+			if (auto cl = slot.ptr<cell>()) in.stack.push(cl->value);
+			else in.stack.push(slot);
+		}
+
+		BICYCLE_HOT_OP void set_cell(interpreter& in, uint32_t* i) {
+			auto& slot = local_scope(in, i[1])->slots[i[2]];
+			if (auto cl = slot.ptr<cell>()) cl->value = std::move(in.stack.top());
+			else slot = std::move(in.stack.top());
+			in.stack.pop();
+		}
+
+		BICYCLE_HOT_OP void get_upvalue(interpreter& in, uint32_t* i) {
+			in.stack.push(in.current_fn->upvalues[i[1]]->value);
+		}
+
+		BICYCLE_HOT_OP void set_upvalue(interpreter& in, uint32_t* i) {
+			in.current_fn->upvalues[i[1]]->value = std::move(in.stack.top());
+			in.stack.pop();
+		}
+
+		inline void get_index(interpreter& in, uint32_t* i) {
+			auto ix = in.stack.top(); in.stack.pop();
+			auto top = in.stack.top(); in.stack.pop();
+			if (auto list = top.ptr<list_value>()) {
+				if (ix.type != value_type::int_) throw std::runtime_error("expected int index to list");
+				in.stack.push(list->values[ix.integer]);
+			}
+			else if (auto map = top.ptr<map_value>()) {
+				auto n = ix.ptr<str_value>();
+				if (n == nullptr) throw std::runtime_error("expected string key");
+				in.stack.push(map->entry(n->key()).first->second);
+			}
+			else if (auto str = top.ptr<str_value>()) {
+				if (ix.type != value_type::int_) throw std::runtime_error("expected int index to string");
+				in.stack.push(str->str()[ix.integer]);
+			}
+			else throw std::runtime_error("attempted to index unindexable value");
+		}
+
+		inline void set_index(interpreter& in, uint32_t* i) {
+			auto v = in.stack.top(); in.stack.pop();
+			auto ix = in.stack.top(); in.stack.pop();
+			auto col = in.stack.top(); in.stack.pop();
+			if (auto list = col.ptr<list_value>()) {
+				if (ix.type != value_type::int_) throw std::runtime_error("expected int index to list");
+				list->values[ix.integer] = v;
+			}
+			else if (auto map = col.ptr<map_value>()) {
+				auto n = ix.ptr<str_value>();
+				if (n == nullptr) throw std::runtime_error("expected string key");
+				map->entry(n->key()).first->second = v;
+			}
+			else throw std::runtime_error("attempted to index unindexable value");
+		}
+
+		inline void append_list(interpreter& in, uint32_t* i) {
+			auto v = in.stack.top(); in.stack.pop();
+			auto list = in.stack.top().as<list_value>();
+			list->values.push_back(v);
+		}
+
+		inline void get_key(interpreter& in, uint32_t* i) {
+			auto n = in.stack.top().as<str_value>(); in.stack.pop();
+			if (n == nullptr)
+				throw std::runtime_error("expected string key");
+			auto map = in.stack.top().as<map_value>(); in.stack.pop();
+			auto val = map->values.find(n->key());
+			in.stack.push(val == map->values.end() ? value() : val->second);
+		}
+
+		inline void set_key(interpreter& in, uint32_t* i) {
+			auto v = in.stack.top(); in.stack.pop();
+			auto n = in.stack.top().as<str_value>(); in.stack.pop();
+			if (n == nullptr)
+				throw std::runtime_error("expected string key");
+			auto map = in.stack.top().as<map_value>();
+			map->entry(n->key()).first->second = v;
+		}
+
+		// the field named by the constant key in map, or nil. While maps keep coming in with
+		// the shape in the cache, that is a compare and a load
+		inline const value& field(interpreter& in, map_value* map, uint32_t key, uint32_t cache) {
+			static const value nil;
+			if (map == nullptr) throw std::runtime_error("expected map");
+			auto& fc = in.code->field_caches[cache];
+			if (map->layout == fc.layout && fc.layout != nullptr) return (map->values.begin() + fc.index)->second;
+			auto k = in.code->constants->values[key].ptr<str_value>();
+			auto f = map->values.find(k->key());
+			if (f == map->values.end()) return nil;
+			if (map->layout != nullptr) {
+				fc.layout = map->layout;
+				fc.next = nullptr;
+				fc.index = (uint32_t)(f - map->values.begin());
+			}
+			return f->second;
+		}
+
+		BICYCLE_HOT_OP void get_field(interpreter& in, uint32_t* i) {
+			auto& top = in.stack.top();
+			top = value(field(in, top.ptr<map_value>(), i[1], i[2]));
+		}
+
+		BICYCLE_HOT_OP void get_local_field(interpreter& in, uint32_t* i) {
+			auto map = local_scope(in, i[1])->slots[i[2]].ptr<map_value>();
+			in.stack.push(field(in, map, i[3], i[4]));
+		}
+
+		BICYCLE_HOT_OP void set_field(interpreter& in, uint32_t* i) {
+			auto v = std::move(in.stack.top()); in.stack.pop();
+			auto map = in.stack.top().ptr<map_value>();
+			if (map == nullptr) throw std::runtime_error("expected map");
+			auto& fc = in.code->field_caches[i[2]];
+			if (map->layout == fc.layout && fc.layout != nullptr) {
+				if (fc.next == nullptr) {
+					(map->values.begin() + fc.index)->second = std::move(v);
+					return;
+				}
+				// the shape says the key isn't there yet, and where it goes
+				auto k = in.code->constants->values[i[1]].ptr<str_value>();
+				map->values.add(k->key())->second = std::move(v);
+				map->layout = fc.next;
+				return;
+			}
+			auto k = in.code->constants->values[i[1]].ptr<str_value>();
+			// if the map still has a shape, it is this one or one after it, which holds it
+			auto before = map->layout.get();
+			auto r = map->entry(k->key());
+			r.first->second = std::move(v);
+			if (before != nullptr && map->layout != nullptr) {
+				fc.layout = rc<shape>(before);
+				fc.next = r.second ? map->layout : nullptr;
+				fc.index = (uint32_t)(r.first - map->values.begin());
+			}
+		}
+	}
+}
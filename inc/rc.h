@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace eval {
+	// a pointer that counts its uses in T::uses, and deletes T when the last one goes
+	template<typename T>
+	struct rc {
+		T* p = nullptr;
+
+		rc() = default;
+		rc(std::nullptr_t) {}
+		explicit rc(T* p) : p(p) { if (p != nullptr) p->uses++; }
+		rc(const rc& other) : rc(other.p) {}
+		rc(rc&& other) noexcept : p(other.p) { other.p = nullptr; }
+		template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+		rc(const rc<U>& other) : rc(static_cast<T*>(other.p)) {}
+		template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+		rc(rc<U>&& other) noexcept : p(other.p) { other.p = nullptr; }
+		~rc() { release(); }
+
+		// other may be owned by what this releases, as in s = s->parent
+		rc& operator=(const rc& other) {
+			auto q = other.p;
+			if (q != nullptr) q->uses++;
+			release();
+			p = q;
+			return *this;
+		}
+		rc& operator=(rc&& other) noexcept {
+			auto q = other.p;
+			other.p = nullptr;
+			release();
+			p = q;
+			return *this;
+		}
+		rc& operator=(std::nullptr_t) {
+			release();
+			return *this;
+		}
+
+		T* get() const { return p; }
+		T* operator->() const { return p; }
+		T& operator*() const { return *p; }
+		explicit operator bool() const { return p != nullptr; }
+		bool operator==(const rc& other) const { return p == other.p; }
+		bool operator!=(const rc& other) const { return p != other.p; }
+		bool operator==(std::nullptr_t) const { return p == nullptr; }
+		bool operator!=(std::nullptr_t) const { return p != nullptr; }
+
+	private:
+		void release() {
+			auto q = p;
+			p = nullptr;
+			if (q != nullptr && --q->uses == 0) delete q;
+		}
+	};
+
+	template<typename T, typename... Args>
+	rc<T> make_rc(Args&&... args) {
+		return rc<T>(new T(std::forward<Args>(args)...));
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+namespace eval {
+	// recycles the small blocks scopes and their slots are made of, through a free list per size
+	namespace region {
+		void* allocate(size_t size);
+		void deallocate(void* p, size_t size);
+	}
+
+	template<typename T>
+	struct region_allocator {
+		using value_type = T;
+
+		region_allocator() = default;
+		template<typename U> region_allocator(const region_allocator<U>&) {}
+
+		T* allocate(size_t n) { return (T*)region::allocate(n * sizeof(T)); }
+		void deallocate(T* p, size_t n) { region::deallocate(p, n * sizeof(T)); }
+
+		template<typename U> bool operator==(const region_allocator<U>&) const { return true; }
+		template<typename U> bool operator!=(const region_allocator<U>&) const { return false; }
+	};
+}
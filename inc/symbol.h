@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include "rc.h"
+
+namespace eval {
+	// the one shared copy of a name or map key, so symbols compare as pointers
+	struct symbol_data {
+		std::string name;
+		size_t hash;
+		// the last rc to go takes it out of the table
+		mutable size_t uses = 0;
+		// bumped whenever any scope gains a binding or module by this name, see binding_cache
+		mutable size_t version = 0;
+
+		symbol_data(std::string name, size_t hash) : name(std::move(name)), hash(hash) {}
+		symbol_data(const symbol_data&) = delete;
+		symbol_data& operator=(const symbol_data&) = delete;
+		~symbol_data();
+	};
+	using symbol = rc<const symbol_data>;
+
+	symbol intern(std::string_view s);
+}
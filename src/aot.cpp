@@ -0,0 +1,90 @@
+#include <iostream>
+#include "aot.h"
+#include "intrp_std.h"
+
+std::shared_ptr<eval::chunk> eval::aot::load_program(loader& ld, const std::filesystem::path& path,
+	const std::vector<std::string>& args)
+{
+	auto code = ld.load_file(path);
+
+	auto vargs = std::vector<value>();
+	vargs.reserve(args.size());
+	for (auto a : args) {
+		vargs.push_back(make_rc<str_value>(a));
+	}
+
+	code.push_back(std::make_shared<literal_instr>(make_rc<list_value>(vargs)));
+	code.push_back(std::make_shared<get_binding_instr>("start"));
+	code.push_back(std::make_shared<call_instr>(1));
+	return assemble(code);
+}
+
+void eval::aot::collect_chunks(const std::shared_ptr<chunk>& top, std::vector<std::shared_ptr<chunk>>& out) {
+	out.push_back(top);
+	for (auto& f : top->fns) collect_chunks(f->body, out);
+}
+
+uint64_t eval::aot::fingerprint(const chunk& c) {
+	// FNV-1a over the code words
+	uint64_t h = 14695981039346656037ull;
+	for (auto w : c.code) {
+		h ^= w;
+		h *= 1099511628211ull;
+	}
+	return h ^ c.code.size();
+}
+
+int eval::aot::run(int argc, char* argv[], const char* path,
+	const embedded_file* files, size_t num_files,
+	const compiled_chunk* chunks, size_t num_chunks)
+{
+	loader ld;
+	ld.read = [&](const std::filesystem::path& p) {
+		for (size_t i = 0; i < num_files; ++i) {
+			if (p.u8string() == files[i].path)
+				return std::vector<uint8_t>(files[i].data, files[i].data + files[i].size);
+		}
+		throw std::runtime_error("module " + p.u8string() + " was not compiled in");
+	};
+
+	std::vector<std::string> args{ path };
+	for (auto i = 1; i < argc; ++i) args.push_back(std::string(argv[i]));
+
+	auto cx = create_global_std_scope();
+	std::shared_ptr<chunk> top;
+	try {
+		top = load_program(ld, path, args);
+	}
+	catch (const std::runtime_error& e) {
+		std::cout << "error: " << e.what() << " in file " << path << std::endl;
+		return -1;
+	}
+
+	std::vector<std::shared_ptr<chunk>> all;
+	collect_chunks(top, all);
+	size_t attached = 0;
+	for (size_t i = 0; i < all.size() && i < num_chunks; ++i) {
+		if (fingerprint(*all[i]) == chunks[i].fingerprint) {
+			all[i]->native = std::make_shared<native_code>(chunks[i].fn);
+			attached++;
+		}
+	}
+	// chunks that don't match were compiled from other bytecode, and only get interpreted
+	if (attached == 0 && all.size() > 0) {
+		std::cout << "error: none of the " << num_chunks << " compiled chunks match " << path << std::endl;
+		return -1;
+	}
+	if (attached < all.size())
+		std::cerr << "only " << attached << " of " << all.size() << " chunks are compiled, the rest will be interpreted" << std::endl;
+
+	interpreter intp(cx, top);
+	try {
+		auto res = intp.run();
+		if (res.has_value() && res->type == value_type::int_) return res->integer;
+		else return 0;
+	}
+	catch (const std::runtime_error& e) {
+		std::cout << "error in start: " << e.what() << std::endl;
+		return -1;
+	}
+}
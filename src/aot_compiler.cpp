@@ -0,0 +1,162 @@
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include "ops.h"
+#include "aot.h"
+
+/*
+	turns a .bcc file, and the modules it includes, into one C++ file. Every chunk becomes a
+	function with a label per instruction: simple instructions call the op from ops.h, jumps
+	and branches are gotos (after ops::loop_back for backward jumps), and calls, returns and
+	natives return the instruction's offset to the interpreter, exactly like the JIT's
+	machine code. The .bcc files are embedded so the
+	program can assemble the same chunks at startup to hang the functions on.
+	Build the output against bicycle_common, with inc/ on the include path.
+*/
+
+static const char* op_name(eval::opcode op) {
+	switch (op) {
+#define X(name, code, width) case eval::opcode::name: return #name;
+		BICYCLE_OPCODES(X)
+#undef X
+	default: throw std::runtime_error("unknown opcode " + std::to_string((uint32_t)op));
+	}
+}
+
+static bool is_simple(eval::opcode op) {
+	switch (op) {
+#define X(name) case eval::opcode::name:
+		BICYCLE_SIMPLE_OPS(X)
+#undef X
+		return true;
+	default: return false;
+	}
+}
+
+static bool is_branch(eval::opcode op) {
+	switch (op) {
+#define X(name) case eval::opcode::name:
+		BICYCLE_BRANCH_OPS(X)
+#undef X
+		return true;
+	default: return false;
+	}
+}
+
+static void emit_chunk(std::ostream& out, const eval::chunk& ch, size_t index, const std::string& title) {
+	using eval::opcode;
+	auto c = ch.code.data();
+	auto end = ch.code.size();
+	std::vector<size_t> starts;
+	for (size_t pc = 0; pc < end; pc += 1 + eval::operand_count((opcode)c[pc])) starts.push_back(pc);
+
+	out << "// " << title << "\n";
+	out << "size_t chunk_" << index << "(interpreter* in, size_t pc) {\n";
+	out << "\tauto c = in->code->code.data();\n";
+	out << "\tswitch (pc) {\n";
+	for (auto pc : starts) out << "\tcase " << pc << ": goto i" << pc << ";\n";
+	out << "\tcase " << end << ": goto i" << end << ";\n";
+	out << "\t}\n";
+	out << "\treturn pc;\n";
+	for (auto pc : starts) {
+		auto op = (opcode)c[pc];
+		out << "i" << pc << ":";
+		if (op == opcode::nop) out << " ;\n";
+		else if (op == opcode::jump) {
+			// loops let the collector run, as they do in the interpreter
+			if (c[pc + 1] <= pc) out << " ops::loop_back(*in, c + " << pc << ");";
+			out << " goto i" << c[pc + 1] << ";\n";
+		}
+		else if (op == opcode::bin_op) {
+			// the int forms fall back to bin_op by themselves, so they cost nothing to try
+			out << " ops::" << op_name(eval::int_form((op_type)c[pc + 1])) << "(*in, c + " << pc << ");\n";
+		}
+		else if (is_simple(op)) out << " ops::" << op_name(op) << "(*in, c + " << pc << ");\n";
+		else if (is_branch(op)) {
+			// the targets are the last two operands
+			auto targets = c + pc + eval::operand_count(op) - 1;
+			auto name = op == opcode::if_bin_op ? op_name(eval::int_branch_form((op_type)c[pc + 1])) : op_name(op);
+			out << " if (ops::" << name << "(*in, c + " << pc << ")) goto i" << targets[0] << "; else goto i" << targets[1] << ";\n";
+		}
+		// calls, returns and natives
+		else out << " return " << pc << ";\n";
+	}
+	out << "i" << end << ": return " << end << ";\n";
+	out << "}\n\n";
+}
+
+// as a C++ string literal
+static std::string quote(const std::string& s) {
+	std::string q = "\"";
+	for (auto ch : s) {
+		if (ch == '\\' || ch == '"') q += '\\';
+		q += ch;
+	}
+	return q + "\"";
+}
+
+static void emit_file(std::ostream& out, size_t index, const std::vector<uint8_t>& data) {
+	out << "const uint8_t file_" << index << "[] = {";
+	for (size_t i = 0; i < data.size(); ++i) {
+		if (i % 16 == 0) out << "\n\t";
+		out << "0x" << std::hex << std::setw(2) << std::setfill('0') << (uint32_t)data[i] << std::dec << ",";
+	}
+	out << "\n};\n\n";
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		std::cout << "usage: bicycle_aot [input .bcc file] [output .cpp file]" << std::endl;
+		return -1;
+	}
+	std::filesystem::path path = std::filesystem::path(argv[1]).lexically_normal();
+
+	// remember every file the loader reads, to embed them
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+	eval::loader ld;
+	ld.read = [&](const std::filesystem::path& p) {
+		auto data = eval::read_file(p);
+		files.push_back({ p.u8string(), data });
+		return data;
+	};
+	auto top = eval::aot::load_program(ld, path, { path.u8string() });
+	std::vector<std::shared_ptr<eval::chunk>> chunks;
+	eval::aot::collect_chunks(top, chunks);
+
+	// the fn each chunk is the body of, for comments
+	std::map<eval::chunk*, std::string> titles;
+	titles[top.get()] = "top level of " + path.u8string();
+	for (auto& ch : chunks) {
+		for (auto& f : ch->fns) {
+			std::ostringstream t;
+			f->print(t);
+			titles[f->body.get()] = t.str();
+		}
+	}
+
+	std::ofstream out(argv[2]);
+	out << "// generated by bicycle_aot from " << path.u8string() << "\n";
+	out << "#include \"ops.h\"\n#include \"aot.h\"\n\nusing namespace eval;\n\nnamespace {\n\n";
+	for (size_t i = 0; i < files.size(); ++i) emit_file(out, i, files[i].second);
+	out << "const aot::embedded_file files[] = {\n";
+	for (size_t i = 0; i < files.size(); ++i)
+		out << "\t{ " << quote(files[i].first) << ", file_" << i << ", sizeof(file_" << i << ") },\n";
+	out << "};\n\n";
+	for (size_t i = 0; i < chunks.size(); ++i) emit_chunk(out, *chunks[i], i, titles[chunks[i].get()]);
+	out << "const aot::compiled_chunk chunks[] = {\n";
+	for (size_t i = 0; i < chunks.size(); ++i)
+		out << "\t{ chunk_" << i << ", " << eval::aot::fingerprint(*chunks[i]) << "ull },\n";
+	out << "};\n\n}\n\n";
+	out << "int main(int argc, char* argv[]) {\n";
+	out << "\treturn aot::run(argc, argv, " << quote(path.u8string()) << ", files, sizeof(files) / sizeof(files[0]),\n";
+	out << "\t\tchunks, sizeof(chunks) / sizeof(chunks[0]));\n";
+	out << "}\n";
+	if (!out) {
+		std::cout << "could not write " << argv[2] << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -7,14 +7,38 @@ void eval::analyzer::visit(ast::seq_stmt* s) {
 
 void eval::analyzer::visit(ast::block_stmt* s) {
 	if (s->body == nullptr) return;
-	instrs.push_back(std::make_shared<enter_scope_instr>());
+	auto block = std::make_shared<lexical_scope>(lexical_scope::block, env);
+	instrs.push_back(std::make_shared<enter_scope_instr>(block));
+	env = block;
 	s->body->visit(this);
-	instrs.push_back(std::make_shared<exit_scope_instr>());
+	env = block->parent;
+	instrs.push_back(std::make_shared<exit_scope_instr>(block));
 }
 
 void eval::analyzer::visit(ast::let_stmt* s) {
+	auto name = ids->at(s->identifer);
+	if (registers && env->kind != lexical_scope::by_name && in_registers(s->value.get())) {
+		assign_in_registers(s->value.get(), [&]() {
+			return std::make_shared<variable>(name, env, env, env->declare(name));
+		});
+		return;
+	}
 	s->value->visit(this);
-	instrs.push_back(std::make_shared<bind_instr>(ids->at(s->identifer)));
+	if (env->kind == lexical_scope::by_name) {
+		if (program != nullptr && program->never_rebound(name)) {
+			auto k = fold(s->value.get());
+			if (k.has_value() && k->type != value_type::boxed) {
+				auto path = module_path;
+				path.push_back(name);
+				program->constants[path] = k.value();
+			}
+		}
+		instrs.push_back(std::make_shared<bind_instr>(name));
+	}
+	else {
+		auto slot = env->declare(name);
+		instrs.push_back(std::make_shared<set_variable_instr>(std::make_shared<variable>(name, env, env, slot)));
+	}
 }
 
 void eval::analyzer::visit(ast::expr_stmt* s) {
@@ -30,10 +54,32 @@ void eval::analyzer::visit(ast::if_stmt* s) {
 	// if false
 	//  other stuff
 	// end
-	s->condition->visit(this);
+	// only the branch a constant condition picks is needed
+	auto k = fold(s->condition.get());
+	if (k.has_value() && k->type == value_type::bool_) {
+		if (k->boolean) s->if_true->visit(this);
+		else if (s->if_false != nullptr) s->if_false->visit(this);
+		return;
+	}
+	// a comparison branches on its result directly
+	auto cmp = std::dynamic_pointer_cast<ast::binary_op>(s->condition);
 	auto true_b_mark = new_marker();
 	auto false_b_mark = new_marker();
-	instrs.push_back(std::make_shared<if_instr>(true_b_mark, false_b_mark));
+	if (cmp != nullptr && registers && env->kind != lexical_scope::by_name && in_registers(cmp.get())) {
+		next_temp = 0;
+		auto a = to_register(cmp->left.get());
+		auto b = to_register(cmp->right.get());
+		instrs.push_back(std::make_shared<if_reg_instr>(true_b_mark, false_b_mark, cmp->op, a, b));
+	}
+	else if (cmp != nullptr && cmp->op != op_type::assign && cmp->op != op_type::dot) {
+		visit_operand(cmp->left);
+		visit_operand(cmp->right);
+		instrs.push_back(std::make_shared<if_instr>(true_b_mark, false_b_mark, cmp->op));
+	}
+	else {
+		s->condition->visit(this);
+		instrs.push_back(std::make_shared<if_instr>(true_b_mark, false_b_mark));
+	}
 	instrs.push_back(std::make_shared<marker_instr>(true_b_mark));
 	s->if_true->visit(this);
 	if (s->if_false != nullptr) {
@@ -47,13 +93,20 @@ void eval::analyzer::visit(ast::if_stmt* s) {
 	}
 }
 
+void eval::analyzer::exit_scopes_to(std::shared_ptr<lexical_scope> outer) {
+	for (auto s = env; s != outer; s = s->parent)
+		instrs.push_back(std::make_shared<exit_scope_instr>(s));
+}
+
 void eval::analyzer::visit(ast::continue_stmt* s) {
 	auto start = 0;
+	std::shared_ptr<lexical_scope> outer;
 	if (s->name.has_value()) {
 		for (int i = loop_marker_stack.size() - 1; i >= 0; --i) {
 			auto loop = loop_marker_stack[i];
 			if (std::get<0>(loop).has_value() && std::get<0>(loop).value() == s->name.value()) {
 				start = std::get<1>(loop);
+				outer = std::get<3>(loop);
 				break;
 			}
 		}
@@ -61,17 +114,21 @@ void eval::analyzer::visit(ast::continue_stmt* s) {
 	else {
 		auto loop = loop_marker_stack[loop_marker_stack.size() - 1];
 		start = std::get<1>(loop);
+		outer = std::get<3>(loop);
 	}
+	exit_scopes_to(outer);
 	instrs.push_back(std::make_shared<jump_instr>(start));
 }
 
 void eval::analyzer::visit(ast::break_stmt* s) {
 	auto end_mark = 0;
+	std::shared_ptr<lexical_scope> outer;
 	if (s->name.has_value()) {
 		for (int i = loop_marker_stack.size() - 1; i >= 0; --i) {
 			auto loop = loop_marker_stack[i];
 			if (std::get<0>(loop).has_value() && std::get<0>(loop).value() == s->name.value()) {
 				end_mark = std::get<2>(loop);
+				outer = std::get<3>(loop);
 				break;
 			}
 		}
@@ -79,14 +136,16 @@ void eval::analyzer::visit(ast::break_stmt* s) {
 	else {
 		auto loop = loop_marker_stack[loop_marker_stack.size() - 1];
 		end_mark = std::get<2>(loop);
+		outer = std::get<3>(loop);
 	}
+	exit_scopes_to(outer);
 	instrs.push_back(std::make_shared<jump_to_marker_instr>(end_mark));
 }
 
 void eval::analyzer::visit(ast::loop_stmt* s) {
 	auto start = instrs.size();
 	auto endm = new_marker();
-	loop_marker_stack.push_back(std::tuple(s->name, start, endm));
+	loop_marker_stack.push_back(std::tuple(s->name, start, endm, env));
 	s->body->visit(this);
 	instrs.push_back(std::make_shared<jump_instr>(start));
 	instrs.push_back(std::make_shared<marker_instr>(endm));
@@ -94,37 +153,48 @@ void eval::analyzer::visit(ast::loop_stmt* s) {
 }
 
 void eval::analyzer::visit(ast::return_stmt* s) {
+	if (auto call = std::dynamic_pointer_cast<ast::fn_call>(s->expr)) {
+		visit(call.get());
+		std::static_pointer_cast<call_instr>(instrs.back())->tail = true;
+		return;
+	}
 	if (s->expr != nullptr) s->expr->visit(this);
 	instrs.push_back(std::make_shared<ret_instr>());
 }
 
 void eval::analyzer::visit(ast::named_value* x) {
-	instrs.push_back(std::make_shared<get_binding_instr>(ids->at(x->identifier)));
+	if (auto k = constant({ ids->at(x->identifier) })) {
+		instrs.push_back(std::make_shared<constant_instr>(k.value()));
+		return;
+	}
+	instrs.push_back(std::make_shared<get_variable_instr>(resolve(ids->at(x->identifier))));
 }
 
 void eval::analyzer::visit(ast::qualified_value* x) {
 	std::vector<std::string> path;
 	for (auto i : x->path) path.push_back(ids->at(i));
+	if (auto k = constant(path)) {
+		instrs.push_back(std::make_shared<constant_instr>(k.value()));
+		return;
+	}
 	instrs.push_back(std::make_shared<get_qualified_binding_instr>(path));
 }
 
 void eval::analyzer::visit(ast::integer_value* x) {
-	auto v = std::make_shared<int_value>(x->value);
-	instrs.push_back(std::make_shared<literal_instr>(v));
+	instrs.push_back(std::make_shared<constant_instr>(value(x->value)));
 }
 
 void eval::analyzer::visit(ast::str_value* x) {
-	auto v = std::make_shared<str_value>(x->value);
+	auto v = make_rc<str_value>(x->value);
 	instrs.push_back(std::make_shared<literal_instr>(v));
 }
 
 void eval::analyzer::visit(ast::bool_value* x) {
-	auto v = std::make_shared<bool_value>(x->value);
-	instrs.push_back(std::make_shared<literal_instr>(v));
+	instrs.push_back(std::make_shared<constant_instr>(value(x->value)));
 }
 
 void eval::analyzer::visit(ast::list_value* x) {
-	auto v = std::make_shared<list_value>();
+	auto v = make_rc<list_value>();
 	instrs.push_back(std::make_shared<literal_instr>(v));
 	for (auto v : x->values) {
 		v->visit(this);
@@ -133,13 +203,11 @@ void eval::analyzer::visit(ast::list_value* x) {
 }
 
 void eval::analyzer::visit(ast::map_value* x) {
-	auto v = std::make_shared<map_value>();
+	auto v = make_rc<map_value>();
 	instrs.push_back(std::make_shared<literal_instr>(v));
 	for (auto v : x->values) {
-		auto n = std::make_shared<str_value>(ids->at(v.first));
-		instrs.push_back(std::make_shared<literal_instr>(n));
 		v.second->visit(this);
-		instrs.push_back(std::make_shared<set_key_instr>());
+		instrs.push_back(std::make_shared<set_field_instr>(ids->at(v.first)));
 	}
 }
 
@@ -149,44 +217,87 @@ void eval::analyzer::visit(ast::binary_op* x) {
 		if (path != nullptr && path->op == op_type::dot) {
 			path->left->visit(this);
 			auto name = ids->at(std::dynamic_pointer_cast<ast::named_value>(path->right)->identifier);
-			instrs.push_back(std::make_shared<literal_instr>(std::make_shared<str_value>(name)));
 			x->right->visit(this);
-			instrs.push_back(std::make_shared<set_key_instr>());
+			instrs.push_back(std::make_shared<set_field_instr>(name));
 			return;
 		}
 		auto index = std::dynamic_pointer_cast<ast::index_into>(x->left);
 		if (index != nullptr) {
 			index->collection->visit(this);
-			index->index->visit(this);
+			visit_operand(index->index);
 			x->right->visit(this);
 			instrs.push_back(std::make_shared<set_index_instr>());
 			return;
 		}
 		auto name = std::dynamic_pointer_cast<ast::named_value>(x->left)->identifier;
+		// x = x + k and x = x - k
+		auto step = std::dynamic_pointer_cast<ast::binary_op>(x->right);
+		if (step != nullptr && (step->op == op_type::add || step->op == op_type::sub)) {
+			auto var = std::dynamic_pointer_cast<ast::named_value>(step->left);
+			auto k = fold(step->right.get());
+			if (var != nullptr && k.has_value() && k->type == value_type::int_ && var->identifier == name) {
+				auto delta = step->op == op_type::add ? k->integer : -k->integer;
+				instrs.push_back(std::make_shared<add_local_instr>(resolve(ids->at(name)), delta));
+				return;
+			}
+		}
+		if (registers && env->kind != lexical_scope::by_name && in_registers(x->right.get())) {
+			assign_in_registers(x->right.get(), [&]() { return resolve(ids->at(name)); });
+			return;
+		}
 		x->right->visit(this);
-		instrs.push_back(std::make_shared<set_binding_instr>(ids->at(name)));
+		instrs.push_back(std::make_shared<set_variable_instr>(resolve(ids->at(name))));
 		return;
 	}
 	else if (x->op == op_type::dot) {
-		x->left->visit(this);
 		auto name = ids->at(std::dynamic_pointer_cast<ast::named_value>(x->right)->identifier);
-		instrs.push_back(std::make_shared<literal_instr>(std::make_shared<str_value>(name)));
-		instrs.push_back(std::make_shared<get_key_instr>());
+		if (auto var = std::dynamic_pointer_cast<ast::named_value>(x->left)) {
+			instrs.push_back(std::make_shared<get_local_field_instr>(resolve(ids->at(var->identifier)), name));
+			return;
+		}
+		x->left->visit(this);
+		instrs.push_back(std::make_shared<get_field_instr>(name));
 		return;
 	}
-	x->left->visit(this);
-	x->right->visit(this);
+	if (auto k = fold(x)) {
+		instrs.push_back(std::make_shared<constant_instr>(k.value()));
+		return;
+	}
+	auto var = std::dynamic_pointer_cast<ast::named_value>(x->left);
+	if (var != nullptr && !constant({ ids->at(var->identifier) }).has_value()) {
+		auto k = fold(x->right.get());
+		if (k.has_value()) {
+			instrs.push_back(std::make_shared<bin_op_local_const_instr>(x->op, resolve(ids->at(var->identifier)), k.value()));
+			return;
+		}
+		if (auto other = std::dynamic_pointer_cast<ast::named_value>(x->right)) {
+			instrs.push_back(std::make_shared<bin_op_locals_instr>(x->op, resolve(ids->at(var->identifier)), resolve(ids->at(other->identifier))));
+			return;
+		}
+	}
+	visit_operand(x->left);
+	visit_operand(x->right);
 	instrs.push_back(std::make_shared<bin_op_instr>(x->op));
 }
 
+void eval::analyzer::visit_operand(std::shared_ptr<ast::expression> x) {
+	if (auto s = std::dynamic_pointer_cast<ast::str_value>(x))
+		instrs.push_back(std::make_shared<constant_instr>(make_rc<str_value>(s->value)));
+	else x->visit(this);
+}
+
 void eval::analyzer::visit(ast::logical_negation* x) {
+	if (auto k = fold(x->value.get()); k.has_value() && k->type == value_type::bool_) {
+		instrs.push_back(std::make_shared<constant_instr>(value(!k->boolean)));
+		return;
+	}
 	x->value->visit(this);
 	instrs.push_back(std::make_shared<log_not_instr>());
 }
 
 void eval::analyzer::visit(ast::index_into* x) {
-	x->collection->visit(this);
-	x->index->visit(this);
+	visit_operand(x->collection);
+	visit_operand(x->index);
 	instrs.push_back(std::make_shared<get_index_instr>());
 }
 
@@ -196,34 +307,384 @@ void eval::analyzer::visit(ast::fn_call* x) {
 			x->args[i]->visit(this);
 		}
 	}
+	auto call = std::make_shared<call_instr>(x->args.size());
 	x->fn->visit(this);
-	instrs.push_back(std::make_shared<call_instr>(x->args.size()));
+	// a fn named by itself is pushed by one instruction, which the call can stand in for
+	if (dynamic_cast<ast::named_value*>(x->fn.get()) || dynamic_cast<ast::qualified_value*>(x->fn.get())) {
+		call->callee = instrs.back();
+		instrs.pop_back();
+	}
+	instrs.push_back(call);
 }
 
 void eval::analyzer::visit(ast::fn_value* x) {
 	std::vector<std::string> arg_names;
-	for (auto an : x->args) arg_names.push_back(ids->at(an));
-	eval::analyzer anl(ids, this->root_path);
-	instrs.push_back(std::make_shared<make_closure_instr>(arg_names, anl.analyze(x->body), x->name));
+	auto fn = std::make_shared<lexical_scope>(lexical_scope::fn, env);
+	for (auto an : x->args) {
+		arg_names.push_back(ids->at(an));
+		fn->declare(ids->at(an));
+	}
+	eval::analyzer anl(ids, this->root_path, fn, program, module_path);
+	anl.free_vars = free_vars;
+	// the outermost block of the body shares the scope of the arguments
+	auto body = x->body;
+	if (auto b = std::dynamic_pointer_cast<ast::block_stmt>(body)) body = b->body;
+	auto code = body == nullptr ? std::vector<std::shared_ptr<instr>>() : anl.analyze(body);
+	instrs.push_back(std::make_shared<make_closure_instr>(arg_names, code, x->name, fn));
 }
 
 void eval::analyzer::visit(ast::module_stmt* s) {
-	if(!s->inner_import) instrs.push_back(std::make_shared<enter_scope_instr>());
+	if (!s->inner_import) {
+		instrs.push_back(std::make_shared<enter_scope_instr>());
+		env = std::make_shared<lexical_scope>(lexical_scope::by_name, env);
+		module_path.push_back(ids->at(s->name));
+	}
 	if (s->body != nullptr) {
 		s->body->visit(this);
 	} else {
-		auto modcode = eval::load_and_assemble(root_path / (ids->at(s->name)+".bcy"));
-		instrs.insert(instrs.end(),
-			std::make_move_iterator(modcode.begin()),
-			std::make_move_iterator(modcode.end()));
+		splice(instrs, eval::load_and_assemble(root_path / (ids->at(s->name)+".bcy"), program, module_path));
+	}
+	if (!s->inner_import) {
+		module_path.pop_back();
+		env = env->parent;
+		instrs.push_back(std::make_shared<exit_scope_as_new_module_instr>(ids->at(s->name)));
 	}
-	if(!s->inner_import) instrs.push_back(std::make_shared<exit_scope_as_new_module_instr>(ids->at(s->name)));
+}
+
+std::optional<eval::value> eval::analyzer::fold(ast::expression* x) {
+	if (auto i = dynamic_cast<ast::integer_value*>(x)) return value(i->value);
+	if (auto b = dynamic_cast<ast::bool_value*>(x)) return value(b->value);
+	// strings are mutable, so these only ever end up as operands
+	if (auto s = dynamic_cast<ast::str_value*>(x)) return value(make_rc<str_value>(s->value));
+	if (auto n = dynamic_cast<ast::named_value*>(x)) return constant({ ids->at(n->identifier) });
+	if (auto q = dynamic_cast<ast::qualified_value*>(x)) {
+		std::vector<std::string> path;
+		for (auto i : q->path) path.push_back(ids->at(i));
+		return constant(path);
+	}
+	if (auto n = dynamic_cast<ast::logical_negation*>(x)) {
+		auto v = fold(n->value.get());
+		if (v.has_value() && v->type == value_type::bool_) return value(!v->boolean);
+		return std::nullopt;
+	}
+	auto op = dynamic_cast<ast::binary_op*>(x);
+	if (op == nullptr || op->op == op_type::assign || op->op == op_type::dot) return std::nullopt;
+	auto a = fold(op->left.get());
+	if (!a.has_value()) return std::nullopt;
+	auto b = fold(op->right.get());
+	if (!b.has_value()) return std::nullopt;
+	// leave errors, including division by zero, to happen when the code runs
+	if (op->op == op_type::div && b->type == value_type::int_ && b->integer == 0) return std::nullopt;
+	try {
+		return apply_bin_op(op->op, a.value(), b.value());
+	}
+	catch (const std::runtime_error&) {
+		return std::nullopt;
+	}
+}
+
+bool eval::analyzer::in_registers(ast::expression* x) {
+	if (auto k = fold(x)) return k->type != value_type::boxed;
+	if (auto n = dynamic_cast<ast::named_value*>(x)) {
+		auto& name = ids->at(n->identifier);
+		for (auto s = env; s != nullptr && s->kind != lexical_scope::by_name; s = s->parent) {
+			if (s->slot(name).has_value()) return true;
+			if (s->kind == lexical_scope::fn) break;
+		}
+		return false;
+	}
+	auto op = dynamic_cast<ast::binary_op*>(x);
+	return op != nullptr && op->op != op_type::assign && op->op != op_type::dot
+		&& in_registers(op->left.get()) && in_registers(op->right.get());
+}
+
+eval::reg_operand eval::analyzer::to_register(ast::expression* x) {
+	if (auto k = fold(x)) return reg_operand{ nullptr, k.value() };
+	if (auto n = dynamic_cast<ast::named_value*>(x)) return reg_operand{ resolve(ids->at(n->identifier)), value() };
+	auto op = dynamic_cast<ast::binary_op*>(x);
+	auto a = to_register(op->left.get());
+	auto b = to_register(op->right.get());
+	// temporaries live in the fn's own scope, so they never make a block exist at runtime.
+	// Outside of fns that is the outermost block, as the scope around it has no slots
+	auto owner = env;
+	while (owner->kind == lexical_scope::block && owner->parent != nullptr
+		&& owner->parent->kind != lexical_scope::by_name) owner = owner->parent;
+	auto name = "%t" + std::to_string(next_temp++);
+	auto t = std::make_shared<variable>(name, env, owner, owner->declare(name));
+	instrs.push_back(std::make_shared<bin_op_reg_instr>(op->op, t, a, b));
+	return reg_operand{ t, value() };
+}
+
+void eval::analyzer::assign_in_registers(ast::expression* x, const std::function<std::shared_ptr<variable>()>& dst) {
+	next_temp = 0;
+	// the operands are resolved before dst, which may be a let shadowing one of them
+	auto op = dynamic_cast<ast::binary_op*>(x);
+	if (op != nullptr && !fold(op).has_value()) {
+		auto a = to_register(op->left.get());
+		auto b = to_register(op->right.get());
+		instrs.push_back(std::make_shared<bin_op_reg_instr>(op->op, dst(), a, b));
+	}
+	else {
+		auto src = to_register(x);
+		instrs.push_back(std::make_shared<move_instr>(dst(), src));
+	}
+}
+
+std::optional<eval::value> eval::analyzer::constant(const std::vector<std::string>& path) {
+	if (program == nullptr) return std::nullopt;
+	// the modules a lookup by name goes through at runtime, innermost first
+	for (size_t depth = module_path.size() + 1; depth > 0; --depth) {
+		std::vector<std::string> key(module_path.begin(), module_path.begin() + (depth - 1));
+		key.insert(key.end(), path.begin(), path.end());
+		auto k = program->constants.find(key);
+		if (k != program->constants.end()) return k->second;
+	}
+	return std::nullopt;
+}
+
+std::shared_ptr<eval::variable> eval::analyzer::resolve(const std::string& name) {
+	// the locals of this fn, as far as they have been declared at this point
+	for (auto s = env; s != nullptr && s->kind != lexical_scope::by_name; s = s->parent) {
+		auto slot = s->slot(name);
+		if (slot.has_value()) return std::make_shared<variable>(name, env, s, slot.value());
+		if (s->kind == lexical_scope::fn) break;
+	}
+	auto v = std::make_shared<variable>(name, env);
+	free_vars->push_back(v);
+	return v;
+}
+
+// the index of fn's upvalue for a slot of enclosing code, adding it (and the upvalues
+// the fns in between need to pass it along) if fn doesn't capture it yet
+static size_t capture_in(const std::shared_ptr<eval::lexical_scope>& fn,
+	const std::shared_ptr<eval::lexical_scope>& scope, size_t slot) {
+	for (size_t i = 0; i < fn->upvalues.size(); ++i)
+		if (fn->upvalues[i].scope == scope && fn->upvalues[i].slot == slot) return i;
+	scope->captured[slot] = true;
+	std::optional<size_t> outer;
+	for (auto s = fn->parent; s != scope; s = s->parent) {
+		if (s->kind == eval::lexical_scope::fn) {
+			outer = capture_in(s, scope, slot);
+			break;
+		}
+	}
+	fn->upvalues.push_back({ scope, slot, outer });
+	return fn->upvalues.size() - 1;
+}
+
+void eval::variable::resolve_free() {
+	if (to != nullptr) return;
+	auto fn = from;
+	while (fn != nullptr && fn->kind == lexical_scope::block) fn = fn->parent;
+	if (fn == nullptr || fn->kind == lexical_scope::by_name) return;
+	for (auto s = fn->parent; s != nullptr && s->kind != lexical_scope::by_name; s = s->parent) {
+		auto sl = s->slot(name);
+		if (sl.has_value()) {
+			upvalue = capture_in(fn, s, sl.value());
+			return;
+		}
+	}
+}
+
+size_t eval::variable::depth() const {
+	size_t depth = 0;
+	for (auto s = from; s != to; s = s->parent)
+		if (s->exists()) depth++;
+	return depth;
+}
+
+std::vector<eval::capture> eval::make_closure_instr::captures() {
+	std::vector<capture> out;
+	for (auto& u : fn->upvalues) {
+		if (u.outer.has_value()) {
+			out.push_back(capture{ true, 0, (uint32_t)u.outer.value() });
+			continue;
+		}
+		uint32_t depth = 0;
+		for (auto s = fn->parent; s != u.scope; s = s->parent)
+			if (s->exists()) depth++;
+		out.push_back(capture{ false, depth, (uint32_t)u.slot });
+	}
+	return out;
+}
+
+std::vector<std::shared_ptr<eval::instr>> eval::link(const std::vector<std::shared_ptr<instr>>& code) {
+	// where each instruction and each marker ends up once the markers are gone
+	std::vector<size_t> new_index;
+	std::map<size_t, size_t> markers;
+	size_t next = 0;
+	for (auto i : code) {
+		new_index.push_back(next);
+		auto m = i->get_marker_id();
+		if (m.has_value()) markers[m.value()] = next;
+		else next++;
+	}
+	new_index.push_back(next);
+
+	auto marker = [&](size_t id) {
+		auto m = markers.find(id);
+		if (m == markers.end()) throw std::runtime_error("unknown marker " + std::to_string(id));
+		return m->second;
+	};
+
+	std::vector<std::shared_ptr<instr>> linked;
+	linked.reserve(next);
+	for (auto i : code) {
+		if (i->get_marker_id().has_value()) continue;
+		if (auto ifi = std::dynamic_pointer_cast<if_instr>(i)) {
+			linked.push_back(std::make_shared<if_abs_instr>(marker(ifi->true_branch), marker(ifi->false_branch), ifi->op));
+		}
+		else if (auto ifr = std::dynamic_pointer_cast<if_reg_instr>(i)) {
+			linked.push_back(std::make_shared<if_reg_abs_instr>(marker(ifr->true_branch), marker(ifr->false_branch), ifr->op, ifr->a, ifr->b));
+		}
+		else if (auto jmi = std::dynamic_pointer_cast<jump_to_marker_instr>(i)) {
+			linked.push_back(std::make_shared<jump_instr>(marker(jmi->id)));
+		}
+		else {
+			i->retarget([&](size_t loc) { return new_index.at(loc); });
+			linked.push_back(i);
+		}
+	}
+	return linked;
+}
+
+void eval::splice(std::vector<std::shared_ptr<instr>>& dst, const std::vector<std::shared_ptr<instr>>& code) {
+	auto offset = dst.size();
+	for (auto i : code) {
+		i->retarget([&](size_t loc) { return loc + offset; });
+		dst.push_back(i);
+	}
+}
+
+// instructions that push a value and do nothing else
+static bool pure_push(const std::shared_ptr<eval::instr>& i) {
+	return std::dynamic_pointer_cast<eval::literal_instr>(i) || std::dynamic_pointer_cast<eval::constant_instr>(i)
+		|| std::dynamic_pointer_cast<eval::duplicate_instr>(i);
+}
+
+// instructions that leave nothing on the stack. Statements leave the stack as they
+// found it, so the discard after one of these as a statement has nothing to pop
+static bool pushes_nothing(const std::shared_ptr<eval::instr>& i) {
+	return std::dynamic_pointer_cast<eval::set_variable_instr>(i) || std::dynamic_pointer_cast<eval::set_binding_instr>(i)
+		|| std::dynamic_pointer_cast<eval::bind_instr>(i) || std::dynamic_pointer_cast<eval::add_local_instr>(i)
+		|| std::dynamic_pointer_cast<eval::set_index_instr>(i) || std::dynamic_pointer_cast<eval::move_instr>(i)
+		|| std::dynamic_pointer_cast<eval::bin_op_reg_instr>(i);
+}
+
+static bool ends_flow(const std::shared_ptr<eval::instr>& i) {
+	if (auto c = std::dynamic_pointer_cast<eval::call_instr>(i)) return c->tail;
+	return std::dynamic_pointer_cast<eval::jump_instr>(i) || std::dynamic_pointer_cast<eval::ret_instr>(i);
+}
+
+// +1 for an instruction that enters a scope at runtime, -1 for one that leaves it
+static int scope_change(const std::shared_ptr<eval::instr>& i) {
+	if (auto e = std::dynamic_pointer_cast<eval::enter_scope_instr>(i)) return e->block == nullptr || e->block->exists() ? 1 : 0;
+	if (auto e = std::dynamic_pointer_cast<eval::exit_scope_instr>(i)) return e->block == nullptr || e->block->exists() ? -1 : 0;
+	if (std::dynamic_pointer_cast<eval::exit_scope_as_new_module_instr>(i)) return -1;
+	return 0;
+}
+
+// whether the scope entered by code[start] can go: nothing gets bound in it, by name
+// or as a module, before the exit_scope that leaves it. Returns that exit
+static std::optional<size_t> removable_scope(const std::vector<std::shared_ptr<eval::instr>>& code, size_t start) {
+	auto e = std::dynamic_pointer_cast<eval::enter_scope_instr>(code[start]);
+	if (e == nullptr || e->block != nullptr) return std::nullopt;
+	size_t depth = 0;
+	for (auto i = start + 1; i < code.size(); ++i) {
+		if (depth == 0 && std::dynamic_pointer_cast<eval::bind_instr>(code[i])) return std::nullopt;
+		if (std::dynamic_pointer_cast<eval::exit_scope_as_new_module_instr>(code[i]) && depth <= 1) return std::nullopt;
+		auto d = scope_change(code[i]);
+		if (d < 0 && depth == 0) {
+			if (std::dynamic_pointer_cast<eval::exit_scope_instr>(code[i])) return i;
+			return std::nullopt;
+		}
+		depth += d;
+	}
+	return std::nullopt;
+}
+
+std::vector<std::shared_ptr<eval::instr>> eval::optimize(const std::vector<std::shared_ptr<instr>>& input) {
+	auto code = input;
+	auto n = code.size();
+
+	// jumps to jumps go straight to the final target, and jumps to ret return right away
+	auto follow = [&](size_t loc) {
+		for (size_t steps = 0; steps < n && loc < n; ++steps) {
+			auto j = std::dynamic_pointer_cast<jump_instr>(code[loc]);
+			if (j == nullptr) break;
+			loc = j->loc;
+		}
+		return loc;
+	};
+	for (auto& i : code) {
+		i->retarget(follow);
+		auto j = std::dynamic_pointer_cast<jump_instr>(i);
+		if (j != nullptr && j->loc < n && std::dynamic_pointer_cast<ret_instr>(code[j->loc]))
+			i = std::make_shared<ret_instr>();
+	}
+
+	std::vector<bool> target(n + 1, false);
+	for (auto& i : code) i->retarget([&](size_t loc) { target.at(loc) = true; return loc; });
+
+	std::vector<bool> dead(n, false);
+	for (size_t i = 0; i < n; ++i) {
+		if (dead[i]) continue;
+		auto next_is = [&](auto pred) { return i + 1 < n && !target[i + 1] && pred(code[i + 1]); };
+		auto is_discard = [](const std::shared_ptr<instr>& x) { return std::dynamic_pointer_cast<discard_instr>(x) != nullptr; };
+		if (pure_push(code[i]) && next_is(is_discard)) {
+			dead[i] = dead[i + 1] = true;
+		}
+		else if (pushes_nothing(code[i]) && next_is(is_discard)) {
+			dead[i + 1] = true;
+		}
+		else if (std::dynamic_pointer_cast<log_not_instr>(code[i]) && next_is([](const std::shared_ptr<instr>& x) {
+			auto b = std::dynamic_pointer_cast<if_abs_instr>(x);
+			return b != nullptr && !b->op.has_value();
+		})) {
+			auto b = std::static_pointer_cast<if_abs_instr>(code[i + 1]);
+			code[i + 1] = std::make_shared<if_abs_instr>(b->false_branch, b->true_branch);
+			dead[i] = true;
+		}
+		else if (scope_change(code[i]) == 0 && (std::dynamic_pointer_cast<enter_scope_instr>(code[i])
+			|| std::dynamic_pointer_cast<exit_scope_instr>(code[i]))) {
+			// blocks that turned out to declare nothing
+			dead[i] = true;
+		}
+		else if (auto exit = removable_scope(code, i)) {
+			dead[i] = dead[exit.value()] = true;
+		}
+		else if (auto j = std::dynamic_pointer_cast<jump_instr>(code[i]); j != nullptr && j->loc == i + 1) {
+			dead[i] = true;
+		}
+		if (ends_flow(code[i])) {
+			for (auto k = i + 1; k < n && !target[k]; ++k) dead[k] = true;
+		}
+	}
+
+	// a jump to something removed lands on whatever follows it
+	std::vector<size_t> new_index(n + 1);
+	size_t next = 0;
+	for (size_t i = 0; i < n; ++i) {
+		new_index[i] = next;
+		if (!dead[i]) next++;
+	}
+	new_index[n] = next;
+
+	std::vector<std::shared_ptr<instr>> out;
+	out.reserve(next);
+	for (size_t i = 0; i < n; ++i) {
+		if (dead[i]) continue;
+		code[i]->retarget([&](size_t loc) { return new_index.at(loc); });
+		out.push_back(code[i]);
+	}
+	return out;
 }
 
 #include <fstream>
 #include "parse.h"
 
-std::vector<std::shared_ptr<eval::instr>> eval::load_and_assemble(const std::filesystem::path& path) {
+std::vector<std::shared_ptr<eval::instr>> eval::load_and_assemble(const std::filesystem::path& path,
+	std::shared_ptr<program_info> program, std::vector<std::string> module_path) {
 	std::ifstream input_stream(path);
 	tokenizer tok(&input_stream);
 	parser par(&tok);
@@ -233,9 +694,9 @@ std::vector<std::shared_ptr<eval::instr>> eval::load_and_assemble(const std::fil
 	while (!tok.peek().is_eof()) {
 		try {
 			auto stmt = par.next_stmt();
-			eval::analyzer anl(&tok.identifiers, path.parent_path());
-			auto part = anl.analyze(stmt);
-			code.insert(code.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+			eval::analyzer anl(&tok.identifiers, path.parent_path(),
+				std::make_shared<lexical_scope>(lexical_scope::by_name, nullptr), program, module_path);
+			splice(code, anl.analyze(stmt));
 		}
 		catch (const parse_error& pe) {
 			std::cout << "parse error: " << pe.what()
@@ -251,3 +712,80 @@ std::vector<std::shared_ptr<eval::instr>> eval::load_and_assemble(const std::fil
 }
 
 
+
+// counts the declarations and assignments of every name in a file for program_info
+class program_scanner : public ast::stmt_visitor, public ast::expr_visitor {
+	eval::program_info* info;
+	std::vector<std::string>* ids;
+	std::filesystem::path root_path;
+public:
+	program_scanner(eval::program_info* info, std::vector<std::string>* ids, std::filesystem::path root_path)
+		: info(info), ids(ids), root_path(root_path) {}
+
+	void visit(ast::seq_stmt* s) override {
+		s->first->visit(this);
+		if (s->second != nullptr) s->second->visit(this);
+	}
+	void visit(ast::block_stmt* s) override { if (s->body != nullptr) s->body->visit(this); }
+	void visit(ast::let_stmt* s) override {
+		info->declarations[ids->at(s->identifer)]++;
+		s->value->visit(this);
+	}
+	void visit(ast::expr_stmt* s) override { s->expr->visit(this); }
+	void visit(ast::if_stmt* s) override {
+		s->condition->visit(this);
+		s->if_true->visit(this);
+		if (s->if_false != nullptr) s->if_false->visit(this);
+	}
+	void visit(ast::continue_stmt* s) override {}
+	void visit(ast::break_stmt* s) override {}
+	void visit(ast::loop_stmt* s) override { s->body->visit(this); }
+	void visit(ast::return_stmt* s) override { if (s->expr != nullptr) s->expr->visit(this); }
+	void visit(ast::module_stmt* s) override {
+		if (s->body != nullptr) s->body->visit(this);
+		else info->scan(root_path / (ids->at(s->name) + ".bcy"));
+	}
+
+	void visit(ast::named_value* x) override {}
+	void visit(ast::qualified_value* x) override {}
+	void visit(ast::integer_value* x) override {}
+	void visit(ast::str_value* x) override {}
+	void visit(ast::bool_value* x) override {}
+	void visit(ast::list_value* x) override { for (auto v : x->values) v->visit(this); }
+	void visit(ast::map_value* x) override { for (auto v : x->values) v.second->visit(this); }
+	void visit(ast::binary_op* x) override {
+		if (x->op == op_type::assign) {
+			if (auto n = std::dynamic_pointer_cast<ast::named_value>(x->left))
+				info->assigned.insert(ids->at(n->identifier));
+		}
+		x->left->visit(this);
+		x->right->visit(this);
+	}
+	void visit(ast::logical_negation* x) override { x->value->visit(this); }
+	void visit(ast::index_into* x) override {
+		x->collection->visit(this);
+		x->index->visit(this);
+	}
+	void visit(ast::fn_call* x) override {
+		x->fn->visit(this);
+		for (auto a : x->args) a->visit(this);
+	}
+	void visit(ast::fn_value* x) override {
+		for (auto a : x->args) info->declarations[ids->at(a)]++;
+		if (x->body != nullptr) x->body->visit(this);
+	}
+};
+
+void eval::program_info::scan(const std::filesystem::path& path) {
+	if (!files.insert(path.lexically_normal()).second) return;
+	std::ifstream input_stream(path);
+	tokenizer tok(&input_stream);
+	parser par(&tok);
+	program_scanner scanner(this, &tok.identifiers, path.parent_path());
+	try {
+		while (!tok.peek().is_eof()) par.next_stmt()->visit(&scanner);
+	}
+	catch (const std::exception&) {
+		complete = false;
+	}
+}
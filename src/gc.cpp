@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <climits>
+#include <vector>
+#include "gc.h"
+#include "rc.h"
+
+namespace {
+	using eval::gc::node;
+
+	// what refs is set to for nodes known to be reachable from outside the heap
+	const long reachable = LONG_MAX;
+
+	struct subtract_reference : eval::gc::tracer {
+		void operator()(node* n) override {
+			if (n->prev != nullptr) n->refs--;
+		}
+	};
+
+	struct mark_reachable : eval::gc::tracer {
+		std::vector<node*>& work;
+		mark_reachable(std::vector<node*>& work) : work(work) {}
+		void operator()(node* n) override {
+			if (n->prev == nullptr || n->refs == reachable) return;
+			n->refs = reachable;
+			work.push_back(n);
+		}
+	};
+}
+
+size_t eval::gc::collect() {
+	auto each = [](auto f) {
+		for (auto l = all.next; l != &all; l = l->next) f(static_cast<node*>(l));
+	};
+	// a node no rc refers to is held some way that can't be seen
+	each([](node* n) { n->refs = n->uses == 0 ? 1 : (long)n->uses; });
+	subtract_reference sub;
+	each([&](node* n) { n->trace(sub); });
+
+	std::vector<node*> work;
+	mark_reachable mark(work);
+	each([&](node* n) { if (n->refs > 0) mark(n); });
+	while (!work.empty()) {
+		auto n = work.back();
+		work.pop_back();
+		n->trace(mark);
+	}
+
+	// held while it is cleared, so nothing is freed before its turn
+	std::vector<rc<node>> garbage;
+	each([&](node* n) { if (n->refs != reachable) garbage.push_back(rc<node>(n)); });
+	for (auto& g : garbage) g->clear();
+	auto freed = garbage.size();
+	garbage.clear();
+
+	next_collection = std::max(min_collection, 2 * live);
+	collections++;
+	return freed;
+}
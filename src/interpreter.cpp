@@ -0,0 +1,366 @@
+#include <utility>
+#include "ops.h"
+
+std::shared_ptr<eval::chunk> eval::assembler::assemble(const std::vector<std::shared_ptr<instr>>& code) {
+	for (auto i : code) {
+		offsets.push_back(out->code.size());
+		i->emit(this);
+	}
+	// jumps are allowed to target one past the last instruction
+	offsets.push_back(out->code.size());
+	for (auto f : fixups) {
+		out->code[f.first] = (uint32_t)offsets.at(f.second);
+	}
+	return out;
+}
+
+std::shared_ptr<eval::chunk> eval::assemble(const std::vector<std::shared_ptr<instr>>& code,
+	std::shared_ptr<constant_pool> constants) {
+	assembler as(constants);
+	return as.assemble(code);
+}
+
+void eval::chunk::print(std::ostream& out) {
+	size_t pc = 0;
+	while (pc < code.size()) {
+		auto op = (opcode)code[pc];
+		auto a = [&](size_t i) { return code[pc + 1 + i]; };
+		auto r = [&](size_t i) {
+			if (a(i) == reg_constant) constants->values[a(i + 1)].print(out);
+			else out << a(i) << ":" << a(i + 1);
+		};
+		out << pc << "\t";
+		switch (op) {
+		case opcode::nop: out << "nop"; break;
+		case opcode::discard: out << "discard"; break;
+		case opcode::duplicate: out << "duplicate"; break;
+		case opcode::literal: out << "literal "; constants->values[a(0)].print(out); break;
+		case opcode::constant: out << "const "; constants->values[a(0)].print(out); break;
+		case opcode::get_binding: out << "get(" << names[a(0)]->name << ")"; break;
+		case opcode::get_qualified_binding: {
+			auto& path = paths[a(0)];
+			out << "get q(";
+			for (size_t i = 0; i < path.size(); ++i) {
+				out << path[i]->name;
+				if (i + 1 < path.size()) out << "::";
+			}
+			out << ")";
+		} break;
+		case opcode::set_binding: out << "set(" << names[a(0)]->name << ")"; break;
+		case opcode::bind: out << "bind(" << names[a(0)]->name << ")"; break;
+		case opcode::enter_scope: out << "scope ["; break;
+		case opcode::exit_scope: out << "] end scope"; break;
+		case opcode::enter_block: out << "scope [ " << a(0) << " slots"; break;
+		case opcode::get_local: out << "get local " << a(0) << ":" << a(1); break;
+		case opcode::set_local: out << "set local " << a(0) << ":" << a(1); break;
+		case opcode::get_cell: out << "get cell " << a(0) << ":" << a(1); break;
+		case opcode::set_cell: out << "set cell " << a(0) << ":" << a(1); break;
+		case opcode::get_upvalue: out << "get upvalue " << a(0); break;
+		case opcode::set_upvalue: out << "set upvalue " << a(0); break;
+		case opcode::exit_scope_as_new_module: out << "] new module(" << names[a(0)]->name << ")"; break;
+		case opcode::if_abs: out << "ifa then " << a(0) << " else " << a(1); break;
+		case opcode::bin_op: out << "bin op "; ast::print_op((op_type)a(0), out); break;
+		case opcode::log_not: out << "notl"; break;
+		case opcode::jump: out << "jmp " << a(0); break;
+		case opcode::make_closure: out << "closure "; fns[a(0)]->print(out); out << std::endl; fns[a(0)]->body->print(out); break;
+		case opcode::call: out << "call"; break;
+		case opcode::call_binding: out << "call(" << names[a(1)]->name << ")"; break;
+		case opcode::call_qualified: {
+			auto& path = paths[a(1)];
+			out << "call q(";
+			for (size_t i = 0; i < path.size(); ++i) {
+				out << path[i]->name;
+				if (i + 1 < path.size()) out << "::";
+			}
+			out << ")";
+			break;
+		}
+		case opcode::tail_call: out << "tail call"; break;
+		case opcode::ret: out << "ret"; break;
+		case opcode::get_index: out << "index"; break;
+		case opcode::set_index: out << "set index"; break;
+		case opcode::get_key: out << "get key"; break;
+		case opcode::set_key: out << "set key"; break;
+		case opcode::get_field: out << "get field "; constants->values[a(0)].print(out); break;
+		case opcode::set_field: out << "set field "; constants->values[a(0)].print(out); break;
+		case opcode::if_bin_op: out << "ifa "; ast::print_op((op_type)a(0), out); out << " then " << a(1) << " else " << a(2); break;
+		case opcode::bin_op_local_const:
+			out << "bin op local " << a(0) << ":" << a(1) << " "; ast::print_op((op_type)a(3), out);
+			out << " "; constants->values[a(2)].print(out);
+			break;
+		case opcode::get_local_field: out << "get field local " << a(0) << ":" << a(1) << " "; constants->values[a(2)].print(out); break;
+		case opcode::bin_op_locals:
+			out << "bin op locals " << a(0) << ":" << a(1) << " "; ast::print_op((op_type)a(4), out); out << " " << a(2) << ":" << a(3);
+			break;
+		case opcode::add_local: out << "add local " << a(0) << ":" << a(1) << " "; constants->values[a(2)].print(out); break;
+		case opcode::move: out << "move " << a(0) << ":" << a(1) << " "; r(2); break;
+		case opcode::bin_op_reg:
+			out << "bin op " << a(0) << ":" << a(1) << " = "; r(2); out << " "; ast::print_op((op_type)a(6), out); out << " "; r(4);
+			break;
+		case opcode::if_bin_op_reg:
+			out << "ifa "; r(0); out << " "; ast::print_op((op_type)a(4), out); out << " "; r(2);
+			out << " then " << a(5) << " else " << a(6);
+			break;
+		case opcode::append_list: out << "append"; break;
+#define X(name, op) \
+		case opcode::name##_int: out << "bin op int "; ast::print_op((op_type)a(0), out); break;
+		BICYCLE_QUICK_OPS(X)
+#undef X
+#define X(name, op) \
+		case opcode::if_##name##_int: out << "ifa int "; ast::print_op((op_type)a(0), out); out << " then " << a(1) << " else " << a(2); break;
+		BICYCLE_QUICK_BRANCHES(X)
+#undef X
+		case opcode::system: out << "system"; break;
+		}
+		out << std::endl;
+		pc += 1 + operand_count(op);
+	}
+}
+
+void eval::interpreter::debug_print_state() {
+	std::cout << "stack [";
+	if(stack.size() > 0) stack.top().print(std::cout);
+	std::cout << "] scope {";
+	/*for (auto b : current_scope->bindings) {
+		std::cout << b.first << "=";
+		b.second->print(std::cout);
+		std::cout << " ";
+	}*/
+	std::cout << "} cur instr = " << code->code[pc] << std::endl;
+}
+
+#ifdef BICYCLE_JIT
+// the JIT's machine code calls these with the interpreter and the instruction. an exception
+// can't unwind through machine code that has no unwind tables, so it is caught here and
+// handed back to run
+template<void(*op)(eval::interpreter&, uint32_t*)>
+static int simple_stub(eval::interpreter* in, uint32_t* i) {
+	try { op(*in, i); return 0; }
+	catch (...) { in->native_error = std::current_exception(); return 2; }
+}
+
+template<bool(*op)(eval::interpreter&, uint32_t*)>
+static int branch_stub(eval::interpreter* in, uint32_t* i) {
+	try { return op(*in, i) ? 1 : 0; }
+	catch (...) { in->native_error = std::current_exception(); return 2; }
+}
+
+eval::jit::stub eval::jit::stub_for(opcode op, bool& branch) {
+	switch (op) {
+#define X(name) case opcode::name: branch = false; return &simple_stub<ops::name>;
+	BICYCLE_SIMPLE_OPS(X)
+#undef X
+#define X(name, oper) case opcode::name##_int: branch = false; return &simple_stub<ops::name##_int>;
+	BICYCLE_QUICK_OPS(X)
+#undef X
+#define X(name) case opcode::name: branch = true; return &branch_stub<ops::name>;
+	BICYCLE_BRANCH_OPS(X)
+#undef X
+#define X(name, oper) case opcode::if_##name##_int: branch = true; return &branch_stub<ops::if_##name##_int>;
+	BICYCLE_QUICK_BRANCHES(X)
+#undef X
+	// only called by jumps backwards, before they jump
+	case opcode::jump: branch = false; return &simple_stub<ops::loop_back>;
+	default: return nullptr;
+	}
+}
+#endif
+
+// GCC and Clang can dispatch through a table of label addresses, which gives
+// every instruction its own indirect branch; everything else uses the switch
+#if defined(__GNUC__)
+#define BICYCLE_THREADED_DISPATCH
+#endif
+
+std::optional<eval::value> eval::interpreter::run() {
+	pc = 0;
+	frames.clear();
+	stack_base = 0;
+	current_fn = nullptr;
+	// not const: quickening rewrites instructions in place
+	uint32_t* c = code->code.data();
+	size_t end = code->code.size();
+	// the fn a call instruction is about to call
+	rc<fn_value> callee;
+
+#ifdef BICYCLE_JIT
+// compiles the current chunk once it has been entered or looped often enough
+#define count_heat() \
+	if (jit_threshold != 0 && ++code->heat == jit_threshold) code->native = jit::compile(*code);
+#else
+#define count_heat()
+#endif
+// runs the current chunk as machine code from pc, if it has any, up to the next
+// instruction only the interpreter can run
+#define enter_native() \
+	if (code->native != nullptr) { \
+		pc = code->native->run(this, pc); \
+		if (pc == jit::failed) std::rethrow_exception(std::exchange(native_error, nullptr)); \
+	}
+
+#ifdef BICYCLE_THREADED_DISPATCH
+	static void* dispatch_table[256];
+	static bool dispatch_table_ready = false;
+	if (!dispatch_table_ready) {
+		for (auto& l : dispatch_table) l = &&op_unknown;
+#define X(name, code, width) dispatch_table[code] = &&op_##name;
+		BICYCLE_OPCODES(X)
+#undef X
+		dispatch_table_ready = true;
+	}
+#define op_case(name) op_##name:
+// running off the end of a chunk returns from it, just like ret
+#define dispatch() if (pc >= end) goto op_ret; goto *dispatch_table[c[pc] & 0xff];
+#define next_instr(n) pc += n; dispatch();
+	dispatch();
+	{
+#else
+#define op_case(name) case opcode::name:
+#define next_instr(n) pc += n; continue;
+	while (true) {
+		//debug_print_state();
+		switch (pc < end ? (opcode)c[pc] : opcode::ret) {
+#endif
+
+	op_case(nop) next_instr(1);
+
+#define X(name) \
+	op_case(name) ops::name(*this, c + pc); next_instr(width::name);
+	BICYCLE_SIMPLE_OPS(X)
+#undef X
+
+#define X(name, oper) \
+	op_case(name##_int) ops::name##_int(*this, c + pc); next_instr(width::name##_int);
+	BICYCLE_QUICK_OPS(X)
+#undef X
+
+	op_case(if_abs)
+		pc = ops::if_abs(*this, c + pc) ? c[pc + 1] : c[pc + 2];
+		next_instr(0);
+
+	op_case(if_bin_op)
+		pc = ops::if_bin_op(*this, c + pc) ? c[pc + 2] : c[pc + 3];
+		next_instr(0);
+
+	op_case(if_bin_op_reg)
+		pc = ops::if_bin_op_reg(*this, c + pc) ? c[pc + 6] : c[pc + 7];
+		next_instr(0);
+
+#define X(name, oper) \
+	op_case(if_##name##_int) \
+		pc = ops::if_##name##_int(*this, c + pc) ? c[pc + 2] : c[pc + 3]; \
+		next_instr(0);
+	BICYCLE_QUICK_BRANCHES(X)
+#undef X
+
+	op_case(jump)
+		// a jump backwards closes a loop, which is as good a sign of heat as a call
+		if (c[pc + 1] <= pc) {
+			ops::loop_back(*this, c + pc);
+			count_heat();
+			pc = c[pc + 1];
+			enter_native();
+		}
+		else pc = c[pc + 1];
+		next_instr(0);
+
+	// the fn is looked up from operands 2 and 3, the way get_binding and get_qualified_binding
+	// look it up from operands 1 and 2
+	op_case(call_binding)
+		callee = ops::cached_binding(*this, c + pc + 1).as<fn_value>();
+		goto call_callee;
+
+	op_case(call_qualified)
+		callee = ops::cached_qualified_binding(*this, c + pc + 1).as<fn_value>();
+		goto call_callee;
+
+	op_case(call)
+	op_case(tail_call)
+		callee = stack.top().as<fn_value>(); stack.pop();
+	call_callee: {
+		gc::poll();
+		auto num_args = c[pc + 1];
+		auto fn = std::move(callee);
+		if (fn == nullptr) throw std::runtime_error("attempted to call a value that is not a function");
+		//if(fn->name.has_value()) std::cout << "call to " << fn->name.value() << std::endl;
+		auto& proto = *fn->proto;
+		auto fncx = scope::make(fn->closure == nullptr ? global_scope : fn->closure, proto.num_locals, !proto.flat);
+		if (num_args != proto.arg_names.size()) {
+			throw std::runtime_error("expected " + std::to_string(proto.arg_names.size()) +
+				" arguments but only got " + std::to_string(num_args));
+		}
+		for (size_t i = 0; i < num_args; ++i) {
+			if (stack.size() <= stack_base)
+				throw std::runtime_error("expected more arguments for fn call, stack bottomed out");
+			if (proto.flat) fncx->slots[i] = std::move(stack.top());
+			// fncx is brand new, so nothing can have cached a lookup through it yet
+			else fncx->bindings.insert_or_assign(proto.arg_symbols[i], stack.top());
+			stack.pop();
+		}
+		if ((opcode)c[pc] == opcode::tail_call) {
+			// nothing the caller left on its part of the stack can matter anymore
+			while (stack.size() > stack_base) stack.pop();
+		}
+		else {
+			// both ways of calling a fn by name step pc by the same amount
+			static_assert(width::call_binding == width::call_qualified, "call_qualified returns past a call_binding's width");
+			auto return_pc = pc + ((opcode)c[pc] == opcode::call ? width::call : width::call_binding);
+			frames.push_back(frame{ return_pc, std::move(code), std::move(current_scope), stack_base, std::move(current_fn) });
+		}
+		code = proto.body;
+		current_fn = std::move(fn);
+		current_scope = std::move(fncx);
+		stack_base = stack.size();
+		c = code->code.data();
+		end = code->code.size();
+		pc = 0;
+		count_heat();
+		enter_native();
+	}
+	next_instr(0);
+
+	op_case(ret)
+		if (frames.empty()) goto halt;
+		{
+			// whatever the callee left on top of its part of the stack is its return value
+			std::optional<value> rv;
+			if (stack.size() > stack_base) rv = std::move(stack.top());
+			while (stack.size() > stack_base) stack.pop();
+			auto& f = frames.back();
+			pc = f.return_pc;
+			code = std::move(f.code);
+			current_scope = std::move(f.cx);
+			stack_base = f.stack_base;
+			current_fn = std::move(f.fn);
+			frames.pop_back();
+			c = code->code.data();
+			end = code->code.size();
+			if (rv.has_value()) stack.push(std::move(rv.value()));
+			enter_native();
+		}
+		next_instr(0);
+
+	op_case(system)
+		code->natives[c[pc + 1]](this);
+		next_instr(2);
+
+#ifdef BICYCLE_THREADED_DISPATCH
+	}
+	op_unknown:
+#else
+		}
+#endif
+		throw std::runtime_error("unknown opcode " + std::to_string(c[pc]));
+#ifndef BICYCLE_THREADED_DISPATCH
+	}
+#endif
+
+#undef op_case
+#undef next_instr
+#undef dispatch
+#undef count_heat
+#undef enter_native
+halt:
+	if (!stack.empty()) return stack.top();
+	else return std::nullopt;
+}
@@ -1,18 +1,18 @@
-#include "..\inc\intrp_std.h"
 #include "intrp_std.h"
 #include <sstream>
 
-std::shared_ptr<eval::value> mk_sys_fn(std::initializer_list<std::string>&& args, std::function<void(eval::interpreter* intrp)> f) {
-	return std::make_shared<eval::fn_value>(std::vector<std::string>(args),
-		std::vector<std::shared_ptr<eval::instr>> {
-		std::make_shared<eval::system_instr>(f)
-	}, nullptr);
+eval::value mk_sys_fn(std::initializer_list<std::string>&& args, std::function<void(eval::interpreter* intrp)> f) {
+	return eval::make_rc<eval::fn_value>(std::make_shared<eval::fn_proto>(std::vector<std::string>(args),
+		eval::assemble(std::vector<std::shared_ptr<eval::instr>> {
+			std::make_shared<eval::system_instr>(f)
+		})), nullptr);
 }
 
-struct ios_value : eval::value {
+struct ios_value : eval::object {
+	static constexpr eval::object_kind tag = eval::object_kind::native;
 	FILE* f;
 
-	ios_value(const std::string& path, const char* mode): f(nullptr) {
+	ios_value(const std::string& path, const char* mode): eval::object(tag), f(nullptr) {
 		if (fopen_s(&f, path.c_str(), mode) != 0) {
 			throw std::runtime_error("error opening file " + path);
 		}
@@ -22,11 +22,11 @@ struct ios_value : eval::value {
 		out << "<filestream@0x" << std::hex << (size_t)f << ">" << std::dec;
 	}
 
-	bool equal(std::shared_ptr<value> other) override {
+	bool equal(const eval::value& other) override {
 		return false;
 	}
 
-	eval::value* clone() override {
+	eval::object* clone() override {
 		throw std::runtime_error("cannot clone file handle");
 	}
 
@@ -38,121 +38,163 @@ struct ios_value : eval::value {
 	}
 };
 
-std::shared_ptr<eval::scope> build_file_api() {
-	auto mod = std::make_shared<eval::scope>(nullptr);
+// a string only the builder holds, so adding to it never copies
+struct str_builder : eval::object {
+	static constexpr eval::object_kind tag = eval::object_kind::native;
+	eval::rc<eval::str_value> text;
+
+	str_builder(eval::rc<eval::str_value> text) : eval::object(tag), text(text) {}
+
+	void print(std::ostream& out) override {
+		out << "<str builder>";
+	}
+
+	bool equal(const eval::value& other) override {
+		return other.ptr<str_builder>() == this;
+	}
+
+	eval::object* clone() override {
+		return new str_builder(eval::rc<eval::str_value>((eval::str_value*)text->clone()));
+	}
+};
+
+eval::rc<eval::scope> build_file_api() {
+	auto mod = eval::make_rc<eval::scope>(nullptr);
 	mod->bind("open", mk_sys_fn({"path"}, [](eval::interpreter* intrp) {
-		auto path = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("path"));
-		intrp->stack.push(std::make_shared<ios_value>(path->value, "r"));
+		auto path = intrp->current_scope->binding("path").as<eval::str_value>();
+		intrp->stack.push(eval::make_rc<ios_value>(std::string(path->str()), "r"));
 	}));
 	mod->bind("create", mk_sys_fn({"path"}, [](eval::interpreter* intrp) {
-		auto path = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("path"));
-		intrp->stack.push(std::make_shared<ios_value>(path->value, "wb"));
+		auto path = intrp->current_scope->binding("path").as<eval::str_value>();
+		intrp->stack.push(eval::make_rc<ios_value>(std::string(path->str()), "wb"));
 	}));
 	mod->bind("next_char", mk_sys_fn({"file"}, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		intrp->stack.push(std::make_shared<eval::int_value>(fgetc(f->f)));
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		intrp->stack.push(eval::value(fgetc(f->f)));
 	}));
 	mod->bind("peek_char", mk_sys_fn({ "file" }, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		intrp->stack.push(std::make_shared<eval::int_value>(fgetc(f->f)));
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		intrp->stack.push(eval::value(fgetc(f->f)));
 		fseek(f->f, -1, SEEK_CUR);
 	}));
 	mod->bind("current_position", mk_sys_fn({"file"}, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		intrp->stack.push(std::make_shared<eval::int_value>(ftell(f->f)));
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		intrp->stack.push(eval::value(ftell(f->f)));
 	}));
 	mod->bind("eof", mk_sys_fn({"file"}, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		intrp->stack.push(std::make_shared<eval::bool_value>(feof(f->f) != 0));
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		intrp->stack.push(eval::value(feof(f->f) != 0));
 	}));
 
 	mod->bind("write_u8", mk_sys_fn({ "file", "v" }, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		auto v = std::dynamic_pointer_cast<eval::int_value>(intrp->current_scope->binding("v"));
-		char value = v->value;
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		auto v = intrp->current_scope->binding("v").as_int();
+		char value = v;
 		std::cout << "w8 " << (uint32_t)value << std::endl;
 		fwrite(&value, sizeof(char), 1, f->f);
 	}));
 
 	mod->bind("write_u32", mk_sys_fn({ "file", "v" }, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		auto v = std::dynamic_pointer_cast<eval::int_value>(intrp->current_scope->binding("v"));
-		uint32_t value = v->value;
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		auto v = intrp->current_scope->binding("v").as_int();
+		uint32_t value = v;
 		fwrite(&value, sizeof(uint32_t), 1, f->f);
 	}));
 
 	mod->bind("write_i32", mk_sys_fn({ "file", "v" }, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		auto v = std::dynamic_pointer_cast<eval::int_value>(intrp->current_scope->binding("v"));
-		int32_t value = v->value;
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		auto v = intrp->current_scope->binding("v").as_int();
+		int32_t value = v;
 		fwrite(&value, sizeof(int32_t), 1, f->f);
 	}));
 
 	mod->bind("write_u64", mk_sys_fn({ "file", "v" }, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		auto v = std::dynamic_pointer_cast<eval::int_value>(intrp->current_scope->binding("v"));
-		uint64_t value = v->value;
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		auto v = intrp->current_scope->binding("v").as_int();
+		uint64_t value = v;
 		fwrite(&value, sizeof(uint64_t), 1, f->f);
 	}));
 
 	mod->bind("write_str", mk_sys_fn({ "file", "v" }, [](eval::interpreter* intrp) {
-		auto f = std::dynamic_pointer_cast<ios_value>(intrp->current_scope->binding("file"));
-		auto v = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("v"));
-		fwrite(v->value.data(), sizeof(char), v->value.length()+1, f->f);
+		auto f = intrp->current_scope->binding("file").as<ios_value>();
+		auto v = intrp->current_scope->binding("v").as<eval::str_value>();
+		// with the terminating nul, which the buffer doesn't necessarily have after the text
+		fwrite(v->str().data(), sizeof(char), v->length, f->f);
+		fputc(0, f->f);
 	}));
 
 
 	return mod;
 }
 
-std::shared_ptr<eval::scope> build_str_api() {
-	auto mod = std::make_shared<eval::scope>(nullptr);
+eval::rc<eval::scope> build_str_api() {
+	auto mod = eval::make_rc<eval::scope>(nullptr);
 	mod->bind("length", mk_sys_fn({ "str" }, [](eval::interpreter* intrp) {
-		auto s = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("str"));
-		intrp->stack.push(std::make_shared<eval::int_value>(s->value.size()));
+		auto s = intrp->current_scope->binding("str").as<eval::str_value>();
+		intrp->stack.push(eval::value(s->length));
 	}));
 	mod->bind("concat", mk_sys_fn({ "a", "b" }, [](eval::interpreter* intrp) {
-		auto a = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("a"));
-		auto b = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("b"));
-		intrp->stack.push(std::make_shared<eval::str_value>(a->value + b->value));
+		auto a = intrp->current_scope->binding("a").as<eval::str_value>();
+		auto b = intrp->current_scope->binding("b").as<eval::str_value>();
+		intrp->stack.push(eval::str_value::concat(a.get(), b.get()));
 	}));
 	mod->bind("append", mk_sys_fn({ "str", "char" }, [](eval::interpreter* intrp) {
-		auto s = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("str"));
-		auto c = std::dynamic_pointer_cast<eval::int_value>(intrp->current_scope->binding("char"));
-		s->value.append(1, (char)c->value);
+		auto s = intrp->current_scope->binding("str").as<eval::str_value>();
+		auto c = intrp->current_scope->binding("char").as_int();
+		char ch = (char)c;
+		s->append(std::string_view(&ch, 1));
 		intrp->stack.push(s);
 	}));
+	mod->bind("builder", mk_sys_fn({}, [](eval::interpreter* intrp) {
+		intrp->stack.push(eval::make_rc<str_builder>(eval::make_rc<eval::str_value>(std::string())));
+	}));
+	// adds a string, or anything else as str::to would write it
+	mod->bind("add", mk_sys_fn({ "builder", "val" }, [](eval::interpreter* intrp) {
+		auto b = intrp->current_scope->binding("builder").as<str_builder>();
+		auto v = intrp->current_scope->binding("val");
+		if (auto s = v.ptr<eval::str_value>()) b->text->append(s->str());
+		else {
+			std::ostringstream oss;
+			v.print(oss);
+			b->text->append(oss.str());
+		}
+		intrp->stack.push(b);
+	}));
+	mod->bind("build", mk_sys_fn({ "builder" }, [](eval::interpreter* intrp) {
+		auto b = intrp->current_scope->binding("builder").as<str_builder>();
+		intrp->stack.push(eval::rc<eval::object>(b->text->clone()));
+	}));
 	mod->bind("to", mk_sys_fn({ "val" }, [](eval::interpreter* intrp) {
 		auto v = intrp->current_scope->binding("val");
 		std::ostringstream oss;
-		v->print(oss);
-		intrp->stack.push(std::make_shared<eval::str_value>(oss.str()));
+		v.print(oss);
+		intrp->stack.push(eval::make_rc<eval::str_value>(oss.str()));
 	}));
 	return mod;
 }
 
-std::shared_ptr<eval::scope> build_list_api() {
-	auto mod = std::make_shared<eval::scope>(nullptr);
+eval::rc<eval::scope> build_list_api() {
+	auto mod = eval::make_rc<eval::scope>(nullptr);
 	mod->bind("length", mk_sys_fn({ "lst" }, [](eval::interpreter* intrp) {
-		auto lst = std::dynamic_pointer_cast<eval::list_value>(intrp->current_scope->binding("lst"));
-		intrp->stack.push(std::make_shared<eval::int_value>(lst->values.size()));
+		auto lst = intrp->current_scope->binding("lst").as<eval::list_value>();
+		intrp->stack.push(eval::value(lst->values.size()));
 	}));
 	mod->bind("concat", mk_sys_fn({ "a", "b" }, [](eval::interpreter* intrp) {
-		auto a = std::dynamic_pointer_cast<eval::list_value>(intrp->current_scope->binding("a"));
-		auto b = std::dynamic_pointer_cast<eval::list_value>(intrp->current_scope->binding("b"));
-		std::vector<std::shared_ptr<eval::value>> vals;
+		auto a = intrp->current_scope->binding("a").as<eval::list_value>();
+		auto b = intrp->current_scope->binding("b").as<eval::list_value>();
+		std::vector<eval::value> vals;
 		vals.insert(vals.end(), a->values.begin(), a->values.end());
 		vals.insert(vals.end(), b->values.begin(), b->values.end());
-		intrp->stack.push(std::make_shared<eval::list_value>(vals));
+		intrp->stack.push(eval::make_rc<eval::list_value>(vals));
 	}));
 	mod->bind("append", mk_sys_fn({ "lst", "x" }, [](eval::interpreter* intrp) {
-		auto s = std::dynamic_pointer_cast<eval::list_value>(intrp->current_scope->binding("lst"));
+		auto s = intrp->current_scope->binding("lst").as<eval::list_value>();
 		auto c = intrp->current_scope->binding("x");
 		s->values.push_back(c);
 		intrp->stack.push(s);
 	}));
 	mod->bind("pop", mk_sys_fn({"lst"}, [](eval::interpreter* intrp) {
-		auto s = std::dynamic_pointer_cast<eval::list_value>(intrp->current_scope->binding("lst"));
+		auto s = intrp->current_scope->binding("lst").as<eval::list_value>();
 		if (s->values.size() == 0) throw std::runtime_error("tried to pop list of len 0");
 		auto t = s->values[s->values.size() - 1];
 		s->values.pop_back();
@@ -161,49 +203,58 @@ std::shared_ptr<eval::scope> build_list_api() {
 	return mod;
 }
 
-std::shared_ptr<eval::scope> build_map_api() {
-	auto mod = std::make_shared<eval::scope>(nullptr);
+eval::rc<eval::scope> build_map_api() {
+	auto mod = eval::make_rc<eval::scope>(nullptr);
 	mod->bind("keys", mk_sys_fn({ "map" }, [](eval::interpreter* intrp) {
-		auto map = std::dynamic_pointer_cast<eval::map_value>(intrp->current_scope->binding("map"));
-		std::vector<std::shared_ptr<eval::value>> keys;
+		auto map = intrp->current_scope->binding("map").as<eval::map_value>();
+		std::vector<eval::value> keys;
 		for (auto kvp : map->values) {
-			keys.push_back(std::make_shared<eval::str_value>(kvp.first));
+			keys.push_back(eval::make_rc<eval::str_value>(kvp.first->name));
 		}
-		intrp->stack.push(std::make_shared<eval::list_value>(keys));
+		intrp->stack.push(eval::make_rc<eval::list_value>(keys));
 	}));
 	return mod;
 }
 
+// gc::collections() is how many times the cycle collector has run, see LANG.md
+eval::rc<eval::scope> build_gc_api() {
+	auto mod = eval::make_rc<eval::scope>(nullptr);
+	mod->bind("collections", mk_sys_fn({}, [](eval::interpreter* intrp) {
+		intrp->stack.push(eval::value(eval::gc::collections));
+	}));
+	return mod;
+}
 
-std::shared_ptr<eval::scope> create_global_std_scope() {
-	auto cx = std::make_shared<eval::scope>(nullptr);
+eval::rc<eval::scope> create_global_std_scope() {
+	auto cx = eval::make_rc<eval::scope>(nullptr);
 
-	cx->bind("nil", std::make_shared<eval::nil_value>());
+	cx->bind("nil", eval::value());
 
 	cx->bind("print", mk_sys_fn({ "str" }, std::function([](eval::interpreter* intrp) {
-		auto v = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("str"));
-		std::cout << v->value;
+		auto v = intrp->current_scope->binding("str").as<eval::str_value>();
+		std::cout << v->str();
 	})));
 	
 	cx->bind("println", mk_sys_fn({ "str" }, std::function([](eval::interpreter* intrp) {
-		auto v = std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("str"));
-		std::cout << v->value << std::endl;
+		auto v = intrp->current_scope->binding("str").as<eval::str_value>();
+		std::cout << v->str() << std::endl;
 	})));
 
 
 	cx->bind("printv", mk_sys_fn({ "val" }, std::function([](eval::interpreter* intrp) {
 		auto v = intrp->current_scope->binding("val");
-		v->print(std::cout);
+		v.print(std::cout);
 	})));
 
 	cx->bind("error", mk_sys_fn({ "msg" }, [](eval::interpreter* intrp) {
-		throw std::runtime_error(std::dynamic_pointer_cast<eval::str_value>(intrp->current_scope->binding("msg"))->value);
+		throw std::runtime_error(std::string(intrp->current_scope->binding("msg").as<eval::str_value>()->str()));
 	}));
 
-	cx->modules["file"] = build_file_api();
-	cx->modules["str"] = build_str_api();
-	cx->modules["list"] = build_list_api();
-	cx->modules["map"] = build_map_api();
+	cx->bind_module(eval::intern("file"), build_file_api());
+	cx->bind_module(eval::intern("str"), build_str_api());
+	cx->bind_module(eval::intern("list"), build_list_api());
+	cx->bind_module(eval::intern("map"), build_map_api());
+	cx->bind_module(eval::intern("gc"), build_gc_api());
 
 	return cx;
 }
@@ -0,0 +1,397 @@
+#include "jit.h"
+#include "eval.h"
+#include "ops.h"
+
+#ifdef BICYCLE_JIT
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+
+namespace {
+	// just enough of an x86-64 assembler to stitch stubs and templates together
+	struct x64 {
+		std::vector<uint8_t> out;
+		// (offset of a rel32, chunk offset it jumps to)
+		std::vector<std::pair<size_t, size_t>> fixups;
+
+		void bytes(std::initializer_list<uint8_t> b) { out.insert(out.end(), b); }
+		void imm32(uint32_t x) { for (auto i = 0; i < 4; ++i) out.push_back((uint8_t)(x >> (8 * i))); }
+		void imm64(uint64_t x) { for (auto i = 0; i < 8; ++i) out.push_back((uint8_t)(x >> (8 * i))); }
+		// a rel32 to the machine code for the instruction at a chunk offset
+		void to(size_t target) {
+			fixups.push_back({ out.size(), target });
+			imm32(0);
+		}
+
+		// mov reg, imm64; 0 is rax, 2 is rdx, 6 is rsi
+		void mov_imm64(uint8_t reg, uint64_t x) { bytes({ 0x48, (uint8_t)(0xb8 + reg) }); imm64(x); }
+		// mov eax, imm32
+		void mov_eax(uint32_t x) { bytes({ 0xb8 }); imm32(x); }
+		void jmp(size_t target) { bytes({ 0xe9 }); to(target); }
+		// jcc with the second byte of the two byte opcode: 0x84 je, 0x85 jne, 0x82 jb
+		void jcc(uint8_t cc, size_t target) { bytes({ 0x0f, cc }); to(target); }
+		// pop rbx; ret
+		void leave() { bytes({ 0x5b, 0xc3 }); }
+
+		// op with a ModRM operand of [base + disp], where reg and base are register numbers:
+		// 0 is rax, 1 rcx, 2 rdx and 3 rbx
+		void mem(std::initializer_list<uint8_t> op, uint8_t reg, uint8_t base, int32_t disp) {
+			bytes(op);
+			out.push_back((uint8_t)(0x80 | (reg << 3) | base));
+			imm32((uint32_t)disp);
+		}
+		// jcc to a label in the machine code that isn't placed yet, which bind places
+		size_t jcc_ahead(uint8_t cc) {
+			bytes({ 0x0f, cc });
+			imm32(0);
+			return out.size() - 4;
+		}
+		void bind(size_t rel32) {
+			auto rel = (int32_t)(out.size() - (rel32 + 4));
+			memcpy(out.data() + rel32, &rel, 4);
+		}
+	};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+	// where the machine code finds the interpreter's state. The templates copy values a word at
+	// a time, with the type in the first one, and read a scope's slots through the pointer the
+	// vector starts with
+	const int32_t current_scope = offsetof(eval::interpreter, current_scope);
+	const int32_t stack_last = offsetof(eval::interpreter, stack) + offsetof(eval::value_stack, last);
+	const int32_t stack_limit = offsetof(eval::interpreter, stack) + offsetof(eval::value_stack, limit);
+	const int32_t scope_parent = offsetof(eval::scope, parent);
+	const int32_t scope_slots = offsetof(eval::scope, slots);
+	const int32_t integer = offsetof(eval::value, integer);
+	const int32_t ref = offsetof(eval::value, ref);
+	const int32_t value_size = sizeof(eval::value);
+	static_assert(offsetof(eval::value, type) == 0 && offsetof(eval::value, integer) == 8 &&
+		offsetof(eval::value, ref) == 16 && sizeof(eval::value) == 24, "the templates copy values as three words");
+	static_assert(sizeof(eval::rc<eval::scope>) == sizeof(void*), "the templates read an rc as its pointer");
+#pragma GCC diagnostic pop
+
+	// whether a vector's first word points at its elements, as in libstdc++ and libc++.
+	// If not, locals are left to the stubs
+	bool slots_readable() {
+		std::vector<eval::value, eval::region_allocator<eval::value>> v(1);
+		void* start;
+		memcpy(&start, &v, sizeof(start));
+		return start == v.data();
+	}
+
+	// the second byte of the jcc for each comparison, on signed ints. setcc is 0x10 more
+	uint8_t condition(eval::opcode op) {
+		switch (op) {
+		case eval::opcode::eq_int: case eval::opcode::if_eq_int: return 0x84;
+		case eval::opcode::neq_int: case eval::opcode::if_neq_int: return 0x85;
+		case eval::opcode::less_int: case eval::opcode::if_less_int: return 0x8c;
+		case eval::opcode::greater_int: case eval::opcode::if_greater_int: return 0x8f;
+		case eval::opcode::less_eq_int: case eval::opcode::if_less_eq_int: return 0x8e;
+		case eval::opcode::greater_eq_int: case eval::opcode::if_greater_eq_int: return 0x8d;
+		default: return 0;
+		}
+	}
+
+	// machine code that does the instruction at pc itself, for the int and local instructions
+	// that run all the time, and adds the jumps to take to the stub when it can't to slow.
+	// Returns false if the instruction has no template
+	bool emit_template(x64& as, eval::chunk& ch, size_t pc, std::vector<size_t>& slow) {
+		using eval::opcode;
+		static const bool slots = slots_readable();
+		auto i = ch.code.data() + pc;
+		auto op = (opcode)(i[0] & 0xff);
+		const uint8_t int_ = (uint8_t)eval::value_type::int_, boxed = (uint8_t)eval::value_type::boxed;
+		auto next = pc + 1 + eval::operand_count(op);
+
+		// rax = the scope a local is in; its slot is at disp(slot)
+		auto walk = [&](uint32_t depth) {
+			// mov rax, [rbx + current_scope]
+			as.mem({ 0x48, 0x8b }, 0, 3, current_scope);
+			// mov rax, [rax + parent]
+			for (uint32_t d = 0; d < depth; ++d) as.mem({ 0x48, 0x8b }, 0, 0, scope_parent);
+			// mov rax, [rax + slots]
+			as.mem({ 0x48, 0x8b }, 0, 0, scope_slots);
+		};
+		auto disp = [&](uint32_t slot) { return (int32_t)(slot * value_size); };
+		// cmp byte [base + d], type; then jcc slow
+		auto check = [&](uint8_t base, int32_t d, uint8_t type, uint8_t cc) {
+			as.mem({ 0x80 }, 7, base, d);
+			as.out.push_back(type);
+			slow.push_back(as.jcc_ahead(cc));
+		};
+		// rcx = the top of the stack, one past the last value
+		auto top = [&]() { as.mem({ 0x48, 0x8b }, 1, 3, stack_last); };
+		// add rcx, n; mov [rbx + last], rcx, which pushes or pops n bytes
+		auto move_top = [&](int32_t n) {
+			as.bytes({ 0x48, 0x81, 0xc1 });
+			as.imm32((uint32_t)n);
+			as.mem({ 0x48, 0x89 }, 1, 3, stack_last);
+		};
+
+		// cmp rcx, [rbx + limit]; je slow, for a push
+		auto room = [&]() {
+			as.mem({ 0x48, 0x3b }, 1, 3, stack_limit);
+			slow.push_back(as.jcc_ahead(0x84));
+		};
+		// pushes rdx op rax, for an op with an int form
+		auto push_result = [&](opcode form) {
+			auto type = eval::value_type::int_;
+			// add, sub or imul rdx, rax
+			if (form == opcode::add_int) as.bytes({ 0x48, 0x01, 0xc2 });
+			else if (form == opcode::sub_int) as.bytes({ 0x48, 0x29, 0xc2 });
+			else if (form == opcode::mul_int) as.bytes({ 0x48, 0x0f, 0xaf, 0xd0 });
+			else {
+				// cmp rdx, rax; setcc dl; movzx edx, dl
+				as.bytes({ 0x48, 0x39, 0xc2, 0x0f, (uint8_t)(condition(form) + 0x10), 0xc2, 0x0f, 0xb6, 0xd2 });
+				type = eval::value_type::bool_;
+			}
+			// mov qword [rcx], type; mov [rcx + integer], rdx; mov qword [rcx + ref], 0
+			as.mem({ 0x48, 0xc7 }, 0, 1, 0);
+			as.imm32((uint32_t)type);
+			as.mem({ 0x48, 0x89 }, 2, 1, integer);
+			as.mem({ 0x48, 0xc7 }, 0, 1, ref);
+			as.imm32(0);
+			move_top(value_size);
+		};
+
+		switch (op) {
+		case opcode::bin_op_local_const: {
+			auto form = eval::int_form((op_type)i[4]);
+			auto& k = ch.constants->values[i[3]];
+			if (!slots || i[1] > 8 || form == opcode::bin_op || k.type != eval::value_type::int_) return false;
+			top();
+			room();
+			walk(i[1]);
+			check(0, disp(i[2]), int_, 0x85);
+			// mov rdx, [rax + slot + integer]; mov rax, k
+			as.mem({ 0x48, 0x8b }, 2, 0, disp(i[2]) + integer);
+			as.mov_imm64(0, (uint64_t)k.integer);
+			push_result(form);
+			as.jmp(next);
+			return true;
+		}
+		case opcode::bin_op_locals: {
+			auto form = eval::int_form((op_type)i[5]);
+			if (!slots || i[1] > 8 || i[3] > 8 || form == opcode::bin_op) return false;
+			top();
+			room();
+			walk(i[1]);
+			check(0, disp(i[2]), int_, 0x85);
+			as.mem({ 0x48, 0x8b }, 2, 0, disp(i[2]) + integer);
+			walk(i[3]);
+			check(0, disp(i[4]), int_, 0x85);
+			// mov rax, [rax + slot + integer]
+			as.mem({ 0x48, 0x8b }, 0, 0, disp(i[4]) + integer);
+			push_result(form);
+			as.jmp(next);
+			return true;
+		}
+		case opcode::get_local: {
+			if (!slots || i[1] > 8) return false;
+			walk(i[1]);
+			check(0, disp(i[2]), boxed, 0x84);
+			top();
+			room();
+			// mov rdx, [rax + slot]; mov [rcx], rdx, for the type and then the int
+			for (int32_t w = 0; w < ref; w += 8) {
+				as.mem({ 0x48, 0x8b }, 2, 0, disp(i[2]) + w);
+				as.mem({ 0x48, 0x89 }, 2, 1, w);
+			}
+			// mov qword [rcx + ref], 0
+			as.mem({ 0x48, 0xc7 }, 0, 1, ref);
+			as.imm32(0);
+			move_top(value_size);
+			as.jmp(next);
+			return true;
+		}
+		case opcode::set_local: {
+			if (!slots || i[1] > 8) return false;
+			top();
+			check(1, -value_size, boxed, 0x84);
+			walk(i[1]);
+			check(0, disp(i[2]), boxed, 0x84);
+			for (int32_t w = 0; w < ref; w += 8) {
+				as.mem({ 0x48, 0x8b }, 2, 1, w - value_size);
+				as.mem({ 0x48, 0x89 }, 2, 0, disp(i[2]) + w);
+			}
+			move_top(-value_size);
+			as.jmp(next);
+			return true;
+		}
+		case opcode::add_local: {
+			if (!slots || i[1] > 8) return false;
+			walk(i[1]);
+			check(0, disp(i[2]), int_, 0x85);
+			// mov rdx, constant; add [rax + slot + integer], rdx
+			as.mov_imm64(2, (uint64_t)ch.constants->values[i[3]].integer);
+			as.mem({ 0x48, 0x01 }, 2, 0, disp(i[2]) + integer);
+			as.jmp(next);
+			return true;
+		}
+#define X(name, oper) case opcode::name##_int:
+		BICYCLE_QUICK_OPS(X)
+#undef X
+		{
+			// a is at rcx - 48 and b at rcx - 24; the result replaces a
+			top();
+			check(1, -value_size, int_, 0x85);
+			check(1, -2 * value_size, int_, 0x85);
+			// mov rax, [rcx + a]
+			as.mem({ 0x48, 0x8b }, 0, 1, integer - 2 * value_size);
+			if (op == opcode::add_int) as.mem({ 0x48, 0x03 }, 0, 1, integer - value_size);
+			else if (op == opcode::sub_int) as.mem({ 0x48, 0x2b }, 0, 1, integer - value_size);
+			else if (op == opcode::mul_int) as.mem({ 0x48, 0x0f, 0xaf }, 0, 1, integer - value_size);
+			else {
+				// cmp rax, [rcx + b]; setcc al; movzx eax, al; mov byte [rcx + a], bool
+				as.mem({ 0x48, 0x3b }, 0, 1, integer - value_size);
+				as.bytes({ 0x0f, (uint8_t)(condition(op) + 0x10), 0xc0, 0x0f, 0xb6, 0xc0 });
+				as.mem({ 0xc6 }, 0, 1, -2 * value_size);
+				as.out.push_back((uint8_t)eval::value_type::bool_);
+			}
+			// mov [rcx + a], rax
+			as.mem({ 0x48, 0x89 }, 0, 1, integer - 2 * value_size);
+			move_top(-value_size);
+			as.jmp(next);
+			return true;
+		}
+#define X(name, oper) case opcode::if_##name##_int:
+		BICYCLE_QUICK_BRANCHES(X)
+#undef X
+		{
+			top();
+			check(1, -value_size, int_, 0x85);
+			check(1, -2 * value_size, int_, 0x85);
+			// mov rax, [rcx + a]; mov rdx, [rcx + b], then pop both before cmp rax, rdx
+			as.mem({ 0x48, 0x8b }, 0, 1, integer - 2 * value_size);
+			as.mem({ 0x48, 0x8b }, 2, 1, integer - value_size);
+			move_top(-2 * value_size);
+			as.bytes({ 0x48, 0x39, 0xd0 });
+			as.jcc(condition(op), i[2]);
+			as.jmp(i[3]);
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+}
+
+eval::native_code::native_code(size_t size) : size(size) {
+	memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) throw std::runtime_error("could not map memory for the JIT");
+	entry = (entry_fn)memory;
+}
+
+eval::native_code::~native_code() {
+	if (memory != nullptr) munmap(memory, size);
+}
+
+std::shared_ptr<eval::native_code> eval::jit::compile(chunk& ch) {
+	auto c = ch.code.data();
+	auto end = ch.code.size();
+	// the chunk offset fail stands for, since no instruction can start there
+	const auto fail = end + 1;
+	std::vector<size_t> labels(end + 2, SIZE_MAX);
+	x64 as;
+	size_t entries_operand;
+	bool worth_it = false;
+
+	// push rbx; mov rbx, rdi; the interpreter stays in rbx, and pushing it
+	// also leaves the stack 16 byte aligned for the calls to stubs
+	as.bytes({ 0x53, 0x48, 0x89, 0xfb });
+	// mov rax, entries; jmp [rax + rsi * 8]
+	entries_operand = as.out.size() + 2;
+	as.mov_imm64(0, 0);
+	as.bytes({ 0xff, 0x24, 0xf0 });
+
+	// mov rdi, rbx; mov rsi, instr; mov rax, stub; call rax
+	auto call = [&](stub s, size_t pc) {
+		as.bytes({ 0x48, 0x89, 0xdf });
+		as.mov_imm64(6, (uint64_t)(c + pc));
+		as.mov_imm64(0, (uint64_t)s);
+		as.bytes({ 0xff, 0xd0 });
+	};
+
+	for (size_t pc = 0; pc < end; pc += 1 + operand_count((opcode)c[pc])) {
+		labels[pc] = as.out.size();
+		auto op = (opcode)(c[pc] & 0xff);
+		if (op == opcode::nop) continue;
+		bool branch;
+		auto s = stub_for(op, branch);
+		if (op == opcode::jump) {
+			// a loop that never leaves the machine code still has to let the collector run
+			if (c[pc + 1] <= pc) {
+				call(s, pc);
+				// test eax, eax; jne fail
+				as.bytes({ 0x85, 0xc0 });
+				as.jcc(0x85, fail);
+			}
+			as.jmp(c[pc + 1]);
+			continue;
+		}
+		if (s == nullptr) {
+			// the interpreter takes it from here
+			as.mov_eax((uint32_t)pc);
+			as.leave();
+			continue;
+		}
+		worth_it = true;
+		std::vector<size_t> slow;
+		if (emit_template(as, ch, pc, slow))
+			for (auto j : slow) as.bind(j);
+		call(s, pc);
+		if (!branch) {
+			// test eax, eax; jne fail
+			as.bytes({ 0x85, 0xc0 });
+			as.jcc(0x85, fail);
+		}
+		else {
+			// cmp eax, 1; je then; jb else; jmp fail
+			as.bytes({ 0x83, 0xf8, 0x01 });
+			// the targets are the last two operands
+			auto targets = c + pc + operand_count((opcode)c[pc]) - 1;
+			as.jcc(0x84, targets[0]);
+			as.jcc(0x82, targets[1]);
+			as.jmp(fail);
+		}
+	}
+	if (!worth_it) return nullptr;
+
+	// falling off the end returns, which is the interpreter's business
+	labels[end] = as.out.size();
+	as.mov_eax((uint32_t)end);
+	as.leave();
+	labels[fail] = as.out.size();
+	// mov rax, -1
+	as.bytes({ 0x48, 0xc7, 0xc0 });
+	as.imm32(UINT32_MAX);
+	as.leave();
+
+	for (auto f : as.fixups) {
+		auto rel = (int32_t)(labels[f.second] - (f.first + 4));
+		memcpy(as.out.data() + f.first, &rel, 4);
+	}
+
+	auto nc = std::make_shared<native_code>(as.out.size());
+	auto base = (uint8_t*)nc->memory;
+	nc->entries.resize(end + 1);
+	for (size_t pc = 0; pc <= end; ++pc)
+		nc->entries[pc] = base + labels[labels[pc] == SIZE_MAX ? fail : pc];
+	auto entries = (uint64_t)nc->entries.data();
+	memcpy(as.out.data() + entries_operand, &entries, 8);
+	memcpy(base, as.out.data(), as.out.size());
+	if (mprotect(base, nc->size, PROT_READ | PROT_EXEC) != 0)
+		throw std::runtime_error("could not make JIT code executable");
+	return nc;
+}
+#else
+eval::native_code::native_code(size_t size) : entry(nullptr) {
+	throw std::runtime_error("the JIT is not supported on this platform");
+}
+
+eval::native_code::~native_code() {}
+
+std::shared_ptr<eval::native_code> eval::jit::compile(chunk& ch) {
+	return nullptr;
+}
+#endif
@@ -0,0 +1,154 @@
+#include <cstdio>
+#include <iostream>
+#include "loader.h"
+
+/*
+	code
+	uint64 num_instrs
+	.. instructions ..
+*/
+
+static std::string load_str(char*& buf) {
+	std::string data(buf);
+	buf += data.length() + 1;
+	return data;
+}
+
+std::vector<std::shared_ptr<eval::instr>> eval::loader::load_code(char*& buf, const std::filesystem::path& root_path) {
+	auto start = buf;
+	uint64_t num_instrs = *((uint64_t*)buf); buf += sizeof(uint64_t);
+	std::vector<std::shared_ptr<eval::instr>> instrs;
+	for (uint64_t i = 0; i < num_instrs; ++i) {
+		auto op = *buf; buf += 1;
+		if (trace) *trace << "offset = " << (buf - start) << std::endl;
+		switch (op) {
+		case 0: /*nop*/ break;
+		case 1: instrs.push_back(std::make_shared<eval::discard_instr>()); break;
+		case 2: instrs.push_back(std::make_shared<eval::duplicate_instr>()); break;
+		case 3: {
+			auto type = *buf; buf += 1;
+			switch (type) {
+			case 0: instrs.push_back(std::make_shared<eval::literal_instr>(eval::value())); break;
+			case 1:
+				instrs.push_back(std::make_shared<eval::literal_instr>(eval::value(*((int32_t*)buf))));
+				buf += sizeof(int32_t);
+				break;
+			case 2: instrs.push_back(std::make_shared<eval::literal_instr>(eval::make_rc<eval::str_value>(load_str(buf)))); break;
+			case 3: instrs.push_back(std::make_shared<eval::literal_instr>(eval::value(*buf != 0))); buf += 1; break;
+			case 4: instrs.push_back(std::make_shared<eval::literal_instr>(eval::make_rc<eval::list_value>())); break;
+			case 5: instrs.push_back(std::make_shared<eval::literal_instr>(eval::make_rc<eval::map_value>())); break;
+			default: throw std::runtime_error("unexpected literal type " + std::to_string(type));
+			}
+		} break;
+
+		case 4: instrs.push_back(std::make_shared<eval::get_binding_instr>(load_str(buf))); break;
+		case 5: {
+			std::vector<std::string> path;
+			auto size = *buf; buf += 1;
+			for (auto i = 0; i < size; ++i)
+				path.push_back(load_str(buf));
+			instrs.push_back(std::make_shared<eval::get_qualified_binding_instr>(path));
+		} break;
+		case 6: instrs.push_back(std::make_shared<eval::set_binding_instr>(load_str(buf))); break;
+		case 7: instrs.push_back(std::make_shared<eval::bind_instr>(load_str(buf))); break;
+
+		case 8: instrs.push_back(std::make_shared<eval::enter_scope_instr>()); break;
+		case 9: instrs.push_back(std::make_shared<eval::exit_scope_instr>()); break;
+		case 10: instrs.push_back(std::make_shared<eval::exit_scope_as_new_module_instr>(load_str(buf))); break;
+
+		case 11:
+			instrs.push_back(std::make_shared<eval::if_instr>(*((uint32_t*)buf), *(1 + (uint32_t*)buf)));
+			buf += 2 * sizeof(uint32_t);
+			break;
+
+		case 51:
+			instrs.push_back(std::make_shared<eval::if_abs_instr>(*((uint32_t*)buf), *(1 + (uint32_t*)buf)));
+			buf += 2 * sizeof(uint32_t);
+			break;
+
+		case 36: {
+			auto op = (op_type)*buf; buf += 1;
+			instrs.push_back(std::make_shared<eval::if_abs_instr>(*((uint32_t*)buf), *(1 + (uint32_t*)buf), op));
+			buf += 2 * sizeof(uint32_t);
+		} break;
+
+		case 12: instrs.push_back(std::make_shared<eval::bin_op_instr>((op_type)*buf)); buf += 1; break;
+		case 13: instrs.push_back(std::make_shared<eval::log_not_instr>()); break;
+
+		case 14: instrs.push_back(std::make_shared<eval::jump_instr>(*((uint32_t*)buf))); buf += sizeof(uint32_t); break;
+		case 15: instrs.push_back(std::make_shared<eval::marker_instr>(*((uint32_t*)buf))); buf += sizeof(uint32_t); break;
+		case 16: instrs.push_back(std::make_shared<eval::jump_to_marker_instr>(*((uint32_t*)buf))); buf += sizeof(uint32_t); break;
+		case 17: {
+			auto anc = *buf; buf += 1;
+			std::optional<std::string> name = std::nullopt;
+			if ((anc & 0x80) == 0x80) {
+				anc ^= 0x80;
+				name = load_str(buf);
+			}
+			std::vector<std::string> arg_names;
+			for (auto i = 0; i < anc; ++i) {
+				arg_names.push_back(load_str(buf));
+			}
+			instrs.push_back(std::make_shared<eval::make_closure_instr>(arg_names, load_code(buf, root_path), name));
+		} break;
+		case 18: instrs.push_back(std::make_shared<eval::call_instr>(*((uint32_t*)buf))); buf += sizeof(uint32_t); break;
+		case 28: instrs.push_back(std::make_shared<eval::call_instr>(*((uint32_t*)buf), true)); buf += sizeof(uint32_t); break;
+		case 19: instrs.push_back(std::make_shared<eval::ret_instr>()); break;
+
+		case 30: instrs.push_back(std::make_shared<eval::get_index_instr>()); break;
+		case 31: instrs.push_back(std::make_shared<eval::set_index_instr>()); break;
+		case 32: instrs.push_back(std::make_shared<eval::get_key_instr>()); break;
+		case 33: instrs.push_back(std::make_shared<eval::set_key_instr>()); break;
+		case 34: instrs.push_back(std::make_shared<eval::get_field_instr>(load_str(buf))); break;
+		case 35: instrs.push_back(std::make_shared<eval::set_field_instr>(load_str(buf))); break;
+		case 50: instrs.push_back(std::make_shared<eval::append_list_instr>()); break;
+
+		case 64: {
+			auto inner_import = *buf; buf += 1;
+			auto name = load_str(buf);
+			auto code = load_file(root_path / (name + ".bcc"));
+			if (!inner_import) instrs.push_back(std::make_shared<eval::enter_scope_instr>());
+			eval::splice(instrs, code);
+			if (!inner_import) instrs.push_back(std::make_shared<eval::exit_scope_as_new_module_instr>(name));
+		} break;
+		default: throw std::runtime_error("unknown opcode " + std::to_string(op));
+		}
+	}
+	instrs = eval::optimize(eval::link(instrs));
+	if (trace) for (auto c : instrs) c->print(*trace);
+	return instrs;
+}
+
+std::vector<uint8_t> eval::read_file(const std::filesystem::path& path) {
+	/*std::ifstream input(path, std::ios::binary);
+	std::vector<uint8_t> buf(std::istream_iterator<uint8_t>(input), {});*/
+	auto size = std::filesystem::file_size(path);
+	FILE* f = fopen(path.u8string().data(), "rb+");
+	std::vector<uint8_t> buf(size, 0);
+	fread(buf.data(), sizeof(uint8_t), size, f);
+	fclose(f);
+	return buf;
+}
+
+eval::loader::loader(std::ostream* trace) : read(read_file), trace(trace) {}
+
+std::vector<std::shared_ptr<eval::instr>> eval::loader::load_file(const std::filesystem::path& path) {
+	try {
+		auto buf = read(path);
+		if (trace) {
+			*trace << std::hex;
+			for (size_t i = 0; i < buf.size(); ++i) {
+				*trace << (uint32_t)buf[i] << " ";
+				if (i > 0 && i % 8 == 0) *trace << std::endl;
+			}
+			*trace << std::dec << std::endl;
+		}
+		char* pbuf = (char*)buf.data();
+		auto code = load_code(pbuf, path.parent_path());
+		return code;
+	}
+	catch (const std::runtime_error& e) {
+		std::cout << "error: " << e.what() << " in file " << path << std::endl;
+		exit(-1);
+	}
+}
@@ -50,7 +50,7 @@ std::shared_ptr<ast::expression> parser::next_basic_expr() {
 			return std::make_shared<ast::list_value>(values);
 		}
 		else if (t.data == (size_t)symbol_type::open_brace) {
-			std::map<size_t, std::shared_ptr<ast::expression>> values;
+			std::vector<std::pair<size_t, std::shared_ptr<ast::expression>>> values;
 			t = tok->peek();
 			if (!t.is_symbol(symbol_type::close_brace)) {
 				while (true) {
@@ -61,7 +61,7 @@ std::shared_ptr<ast::expression> parser::next_basic_expr() {
 					if (t.type != token::symbol || t.data != (size_t)symbol_type::colon) {
 						error(t, "expected colon after key in map");
 					}
-					values[key] = this->next_expr();
+					values.push_back({ key, this->next_expr() });
 					t = tok->next();
 					if (t.type == token::symbol) {
 						if (t.data == (size_t)symbol_type::close_brace) { break; }
@@ -0,0 +1,46 @@
+#include "region.h"
+#include <new>
+
+namespace {
+	// blocks are rounded up to granules, which keeps everything 16 byte aligned
+	constexpr size_t granule = 16;
+	constexpr size_t max_block = 512;
+	constexpr size_t chunk_size = 64 * 1024;
+
+	struct free_block { free_block* next; };
+
+	free_block* free_lists[max_block / granule];
+	char* chunk_next = nullptr;
+	char* chunk_end = nullptr;
+
+	inline size_t size_class(size_t size) { return size == 0 ? 0 : (size - 1) / granule; }
+}
+
+void* eval::region::allocate(size_t size) {
+	if (size > max_block) return ::operator new(size);
+	auto c = size_class(size);
+	if (auto b = free_lists[c]) {
+		free_lists[c] = b->next;
+		return b;
+	}
+	auto bytes = (c + 1) * granule;
+	if ((size_t)(chunk_end - chunk_next) < bytes) {
+		// whatever is left of the old chunk is too small for this class and gets wasted
+		chunk_next = (char*)::operator new(chunk_size);
+		chunk_end = chunk_next + chunk_size;
+	}
+	auto p = chunk_next;
+	chunk_next += bytes;
+	return p;
+}
+
+void eval::region::deallocate(void* p, size_t size) {
+	if (size > max_block) {
+		::operator delete(p);
+		return;
+	}
+	auto b = (free_block*)p;
+	auto c = size_class(size);
+	b->next = free_lists[c];
+	free_lists[c] = b;
+}
@@ -78,13 +78,19 @@ std::tuple<bool, std::optional<std::filesystem::path>, std::vector<std::string>>
 	auto prog_args = std::vector<std::string>();
 
 	if (args.size() == 0) {
-		std::cout << "pass a filename and/or -i to open the REPL" << std::endl;
+		std::cout << "pass a filename and/or -i to open the REPL, -j to JIT hot code and -r to use register instructions" << std::endl;
 	}
 
-	for (auto i = 0; i < args.size(); ++i) {
+	for (size_t i = 0; i < args.size(); ++i) {
 		if (args[i] == "-i") {
 			use_repl = true;
 		}
+		else if (args[i] == "-j") {
+			eval::interpreter::jit_threshold = eval::jit::default_threshold;
+		}
+		else if (args[i] == "-r") {
+			eval::analyzer::registers = true;
+		}
 		else if (args[i] == "--") {
 			for (auto j = i + 1; j < args.size(); ++j)
 				prog_args.push_back(args[j]);
@@ -101,18 +107,24 @@ std::tuple<bool, std::optional<std::filesystem::path>, std::vector<std::string>>
 	return std::tuple{ use_repl, file, prog_args };
 }
 
-void load_file(tokenizer* tok, parser* par, std::shared_ptr<eval::scope> cx, std::filesystem::path path) {
+void load_file(tokenizer* tok, parser* par, eval::rc<eval::scope> cx, std::filesystem::path path, bool use_repl) {
 	std::ifstream input_stream(path);
 	tok->reset(&input_stream);
 
+	auto program = std::make_shared<eval::program_info>();
+	program->scan(path);
+	// what gets typed into the REPL can assign any of the file's lets
+	if (use_repl) program->complete = false;
+
 	ast::printer printer(std::cout, &tok->identifiers, 0);
 	while (!tok->peek().is_eof()) {
 		try {
 			auto stmt = par->next_stmt();
 			//stmt->visit(&printer);
 			//std::cout << std::endl;
-			eval::analyzer anl(&tok->identifiers, path.parent_path());
-			eval::interpreter intp(cx, anl.analyze(stmt));
+			eval::analyzer anl(&tok->identifiers, path.parent_path(),
+				std::make_shared<eval::lexical_scope>(eval::lexical_scope::by_name, nullptr), program);
+			eval::interpreter intp(cx, eval::assemble(anl.analyze(stmt)));
 			//std::cout << std::endl;
 			//for (auto c : intp.code) c->print(std::cout);
 			intp.run();
@@ -149,7 +161,7 @@ int main(int argc, char* argv[]) {
 
 	auto cx = create_global_std_scope();
 
-	if(file.has_value()) load_file(&tk, &p, cx, file.value());
+	if(file.has_value()) load_file(&tk, &p, cx, file.value(), use_repl);
 
 	if (use_repl) {
 		ast::printer printer(std::cout, &tk.identifiers, 1);
@@ -158,7 +170,7 @@ int main(int argc, char* argv[]) {
 			std::cout << std::endl << ">";
 			std::getline(std::cin, line);
 			if (line == "!r") {
-				if (file.has_value()) load_file(&tk, &p, cx, file.value());
+				if (file.has_value()) load_file(&tk, &p, cx, file.value(), use_repl);
 				continue;
 			}
 			if (line == "!q") {
@@ -174,11 +186,11 @@ int main(int argc, char* argv[]) {
 				auto code = anl.analyze(std::make_shared<ast::return_stmt>(expr));
 				std::cout << std::endl;
 				for (auto c : code) c->print(std::cout);
-				eval::interpreter intp(cx, code);
+				eval::interpreter intp(cx, eval::assemble(code));
 
 				std::cout << " = ";
 				auto res = intp.run();
-				if (res != nullptr) {
+				if (res.has_value()) {
 					res->print(std::cout);
 				}
 				else {
@@ -194,22 +206,22 @@ int main(int argc, char* argv[]) {
 			}
 		}
 	} else if(file.has_value()) {
-		auto vargs = std::vector<std::shared_ptr<eval::value>>();
+		auto vargs = std::vector<eval::value>();
 		vargs.reserve(prog_args.size() + 1);
-		vargs.push_back(std::make_shared<eval::str_value>(file.value().u8string()));
+		vargs.push_back(eval::make_rc<eval::str_value>(file.value().u8string()));
 		for (auto a : prog_args) {
-			vargs.push_back(std::make_shared<eval::str_value>(a));
+			vargs.push_back(eval::make_rc<eval::str_value>(a));
 		}
 
 		std::vector<std::shared_ptr<eval::instr>> code;
-		code.push_back(std::make_shared<eval::literal_instr>(std::make_shared<eval::list_value>(vargs)));
+		code.push_back(std::make_shared<eval::literal_instr>(eval::make_rc<eval::list_value>(vargs)));
 		code.push_back(std::make_shared<eval::get_binding_instr>("start"));
 		code.push_back(std::make_shared<eval::call_instr>(1));
 
-		eval::interpreter intp(cx, code);
+		eval::interpreter intp(cx, eval::assemble(code));
 		try {
-			auto res = std::dynamic_pointer_cast<eval::int_value>(intp.run());
-			if (res != nullptr) return res->value;
+			auto res = intp.run();
+			if (res.has_value() && res->type == eval::value_type::int_) return res->integer;
 			else return 0;
 		}
 		catch (const std::runtime_error& e) {
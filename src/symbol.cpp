@@ -0,0 +1,25 @@
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+#include "symbol.h"
+
+namespace {
+	// never freed, so symbols destroyed at exit can still take themselves out
+	auto& table() {
+		static auto t = new std::unordered_map<std::string_view, const eval::symbol_data*>();
+		return *t;
+	}
+}
+
+eval::symbol_data::~symbol_data() {
+	table().erase(name);
+}
+
+eval::symbol eval::intern(std::string_view s) {
+	auto& t = table();
+	auto f = t.find(s);
+	if (f != t.end()) return symbol(f->second);
+	auto sym = new symbol_data(std::string(s), std::hash<std::string_view>{}(s));
+	t.emplace(sym->name, sym);
+	return symbol(sym);
+}
@@ -0,0 +1,5 @@
+# runs bicycle_src_intrp -i on file with input typed into the REPL, for bicycle_repl_test
+execute_process(COMMAND ${intrp} -i ${file} INPUT_FILE ${input} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "bicycle_src_intrp exited with ${result}")
+endif()